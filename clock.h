@@ -2,6 +2,9 @@
 #ifndef CLOCK_H
 #define CLOCK_H 1
 
+#include <stdint.h>
+#include <time.h>
+
 /*  minimum resolution of timer (secs) */
 extern const double timer_resolution;
 
@@ -23,4 +26,18 @@ void start_counter(void);
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter(void);
 
+/* Ticks: cheap enough to read around every single request */
+/* Read the time stamp counter, or a nanosecond clock where there is none */
+static inline uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
 #endif
@@ -120,6 +120,19 @@
  */
 #define ALIGNMENT 16
 
+/*
+ * Most threads a threaded replay (-P) may use, and the number of runs
+ * each of its measurements takes the best of
+ */
+#define MAX_REPLAY_THREADS 64
+#define SCALING_REPS 3
+
+/*
+ * Blocks a producer may hand to its consumer in a producer/consumer
+ * replay (-Q) before it has to wait; must be a power of two
+ */
+#define HANDOFF_SLOTS 4096
+
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
  * Maximum heap size in bytes
@@ -11,10 +11,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +30,7 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
@@ -39,6 +44,10 @@
 /* Misc */
 #define MAXLINE 1024 /* max string size */
 #define HDRLINES 4   /* number of header lines in a trace file */
+#define RESIDENT_PERIOD 64 /* requests between samples of resident bytes */
+#define HIST_SUB_LOG2 3    /* log2 of linear sub-buckets per power of two */
+#define HIST_SUB (1 << HIST_SUB_LOG2)
+#define HIST_BUCKETS ((64 - HIST_SUB_LOG2 + 1) * HIST_SUB)
 #define LINENUM(i)                                                             \
     (i + HDRLINES + 1) /* cnvt trace request nums to linenums (origin 1) */
 
@@ -86,9 +95,19 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    unsigned int index;                 /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
+    enum {
+        ALLOC,
+        FREE,
+        REALLOC,
+        ALLOC_BATCH,
+        FREE_BATCH,
+        ALLOC_ALIGNED,
+        NUM_OP_TYPES /* number of request types, not a request */
+    } type;             /* request */
+    unsigned int index; /* index for free() to use later; first of a batch */
+    unsigned int count; /* number of consecutive ids a batch request covers */
+    unsigned int align; /* payload alignment of an aligned alloc request */
+    size_t size;        /* byte size of alloc/realloc request */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -97,6 +116,7 @@ typedef struct {
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     unsigned int num_ids; /* number of alloc/realloc ids */
     unsigned int num_ops; /* number of distinct requests */
+    unsigned int num_aligned; /* number of aligned alloc requests */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
@@ -114,6 +134,49 @@ typedef struct {
     range_set_t *ranges;
 } speed_t;
 
+/*
+ * Log-linear histogram of request latencies, in ticks of read_ticks.
+ * Values below HIST_SUB have a bucket each; every power of two above is
+ * split into HIST_SUB equal buckets, so a bucket is never wider than
+ * 1/HIST_SUB of the values in it.
+ */
+typedef struct {
+    unsigned long count[HIST_BUCKETS]; /* requests per bucket */
+    unsigned long total;               /* requests recorded */
+    uint64_t sum;                      /* sum of the latencies recorded */
+    uint64_t max;                      /* longest latency recorded */
+} hist_t;
+
+/*
+ * A single-producer single-consumer ring over which a producer thread
+ * hands the blocks it frees to a consumer thread, which frees them.
+ */
+typedef struct {
+    char **slots;             /* HANDOFF_SLOTS blocks waiting to be freed */
+    _Atomic size_t head;      /* count of blocks the consumer has freed */
+    _Atomic size_t tail;      /* count of blocks the producer handed over */
+    _Atomic bool done;        /* set once the producer has finished */
+    double started;           /* wall-clock time the consumer began */
+    double secs;              /* wall-clock time the consumer ran */
+    pthread_barrier_t *start; /* released once every thread is ready */
+} handoff_t;
+
+/*
+ * One thread's share of a threaded replay: a whole trace, or the requests
+ * of one trace on every n-th id.
+ */
+typedef struct {
+    traceop_t *ops;           /* requests to replay, in trace order */
+    unsigned int num_ops;     /* number of requests */
+    unsigned int num_blocks;  /* blocks requested, counting each of a batch */
+    unsigned int num_ids;     /* number of alloc/realloc ids */
+    char **blocks;            /* ptrs returned by mm_malloc/mm_realloc */
+    double started;           /* wall-clock time the last replay began */
+    double secs;              /* wall-clock time of the last replay */
+    pthread_barrier_t *start; /* released once every thread is ready */
+    handoff_t *queue;         /* if set, frees go to this consumer */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -166,6 +229,9 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool sized_mode = false; /* Pass known block sizes to free/realloc */
+static bool latency_mode = false; /* Histogram request latencies */
+static FILE *latency_csv = NULL;  /* If set, histograms are dumped here */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -200,6 +266,24 @@ static char autoresult[MAXLINE]; /* autoresult string */
 static sum_stats_t global_libc_sum_stats;
 static sum_stats_t global_mm_sum_stats;
 
+/* Allocator statistics at the end of the last efficiency run */
+static struct mm_stats util_stats;
+
+#if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
+/* Latency histograms of the last trace, one per request type */
+static hist_t latency_hists[NUM_OP_TYPES];
+#endif
+
+/* Request type names */
+static const char *op_names[NUM_OP_TYPES] = {
+    [ALLOC] = "malloc",
+    [FREE] = "free",
+    [REALLOC] = "realloc",
+    [ALLOC_BATCH] = "malloc_batch",
+    [FREE_BATCH] = "free_batch",
+    [ALLOC_ALIGNED] = "memalign",
+};
+
 /* Performance statistics for driver */
 
 /*********************
@@ -236,11 +320,21 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, size_t tracenum);
+static double eval_mm_util(trace_t *trace, size_t tracenum, bool padded);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, hist_t *hists);
+
+/* Routines for measuring how the mm package scales over threads */
+static void replay_ops(const traceop_t *ops, unsigned int num_ops,
+                       char **blocks, size_t *sizes, handoff_t *queue,
+                       hist_t *hists);
+static void eval_mm_scaling(unsigned int max_threads);
+static void eval_mm_pipeline(unsigned int max_pairs);
 
 /* Various helper routines */
 static void printresults(size_t n, stats_t *stats, sum_stats_t *sumstats);
+static void print_mm_stats(const struct mm_stats *stats);
+static void print_latency(const trace_t *trace, const hist_t *hists);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, unsigned int opnum,
                          const char *fmt, ...)
@@ -285,7 +379,6 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0) {
@@ -314,7 +407,10 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf(", efficiency");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, false);
+            if (verbose > 1 && trace->num_aligned > 0)
+                printf(" (util %.1f%% if aligned requests are padded)",
+                       100.0 * eval_mm_util(trace, i, true));
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -322,12 +418,20 @@ static void run_tests(size_t num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (latency_mode && !sparse_mode)
+                eval_mm_latency(trace, latency_hists);
         }
 #endif
         if (verbose > 0)
             putchar('.');
         if (verbose > 1)
             putchar('\n');
+#if !defined DEBUG && !defined USE_ASAN && !defined USE_MSAN
+        if (verbose > 1 && mm_stats[i].valid)
+            print_mm_stats(&util_stats);
+        if (latency_mode && !sparse_mode && mm_stats[i].valid)
+            print_latency(trace, latency_hists);
+#endif
 
 #if 0
         printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
@@ -366,10 +470,18 @@ int main(int argc, char **argv) {
 #if !REF_ONLY
 
     int c;
+    long fit_candidates = 0; /* If set, fit search bound (set by -F) */
+    long reserve = -1;       /* If set, realloc slack percent (set by -R) */
+    long quick_limit = -1;   /* If set, quick list byte bound (set by -K) */
+    long map_threshold = -1; /* If set, smallest mapped request (set by -M) */
+    long release_threshold = -1; /* If set, smallest released block (-G) */
+    int replay_threads = 0;  /* If set, threads for scaling run (set by -P) */
+    int replay_pairs = 0;    /* If set, pairs for pipeline run (set by -Q) */
+
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:F:R:K:M:G:P:Q:H:hpCOVAlDSTL")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -428,6 +540,77 @@ int main(int argc, char **argv) {
             tab_mode = true;
             break;
 
+        case 'S': /* Free and realloc through the sized entry points */
+            sized_mode = true;
+            break;
+
+        case 'L': /* Histogram the latency of every request */
+            latency_mode = true;
+            break;
+
+        case 'H': /* Histogram latencies and dump them to a CSV file */
+            latency_mode = true;
+            if ((latency_csv = fopen(optarg, "w")) == NULL)
+                unix_error("Could not open latency CSV file");
+            fprintf(latency_csv, "trace,op,lo,hi,count\n");
+            break;
+
+        case 'F': /* Bound the free blocks examined per fit search */
+            fit_candidates = atol(optarg);
+            if (!mm_mallopt(MM_FIT_CANDIDATES, fit_candidates)) {
+                fprintf(stderr, "Invalid fit search bound %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'R': /* Slack reserved behind repeatedly grown blocks */
+            reserve = atol(optarg);
+            if (!mm_mallopt(MM_REALLOC_RESERVE, reserve)) {
+                fprintf(stderr, "Invalid realloc reserve %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'K': /* Freed bytes kept uncoalesced on the quick lists */
+            quick_limit = atol(optarg);
+            if (!mm_mallopt(MM_QUICK_LIMIT, quick_limit)) {
+                fprintf(stderr, "Invalid quick list limit %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'M': /* Requests given regions of their own from this size */
+            map_threshold = atol(optarg);
+            if (!mm_mallopt(MM_MAP_THRESHOLD, map_threshold)) {
+                fprintf(stderr, "Invalid map threshold %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'G': /* Free blocks whose idle pages are given back */
+            release_threshold = atol(optarg);
+            if (!mm_mallopt(MM_RELEASE_THRESHOLD, release_threshold)) {
+                fprintf(stderr, "Invalid release threshold %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'P': /* Replay on up to this many threads and report scaling */
+            replay_threads = atoi(optarg);
+            if (replay_threads < 1 || replay_threads > MAX_REPLAY_THREADS) {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                exit(1);
+            }
+            break;
+
+        case 'Q': /* Replay as up to this many producer/consumer pairs */
+            replay_pairs = atoi(optarg);
+            if (replay_pairs < 1 || 2 * replay_pairs > MAX_REPLAY_THREADS) {
+                fprintf(stderr, "Invalid pair count %s\n", optarg);
+                exit(1);
+            }
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -459,6 +642,25 @@ int main(int argc, char **argv) {
         alarm((unsigned int)set_timeout);
     }
 
+#if defined DEBUG || defined USE_ASAN || defined USE_MSAN
+    /* These drivers skip the timed runs the histograms come from */
+    if (latency_mode)
+        app_error("Latency histograms need the release driver\n");
+#endif
+
+#if !REF_ONLY
+    /* A scaling or pipeline run replaces the usual evaluation */
+    if (replay_threads > 0 || replay_pairs > 0) {
+        if (sparse_mode)
+            app_error("Threaded replay needs the dense heap");
+        if (replay_threads > 0)
+            eval_mm_scaling((unsigned int)replay_threads);
+        if (replay_pairs > 0)
+            eval_mm_pipeline((unsigned int)replay_pairs);
+        exit(errors == 0 ? 0 : 1);
+    }
+#endif
+
     /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -512,6 +714,28 @@ int main(int argc, char **argv) {
     if (verbose > 0) {
         printf("Throughput targets: min=%.0f, max=%.0f, benchmark=%.0f\n",
                min_throughput, max_throughput, ref_throughput);
+        if (fit_candidates > 0) {
+            printf("Fit search examines up to %ld free blocks\n",
+                   fit_candidates);
+        }
+        if (reserve >= 0) {
+            printf("Realloc reserves %ld%% slack behind growing blocks\n",
+                   reserve);
+        }
+        if (quick_limit >= 0) {
+            printf("Quick lists hold up to %ld freed bytes\n", quick_limit);
+        }
+        if (map_threshold >= 0) {
+            printf("Requests of %ld bytes or more are mapped\n",
+                   map_threshold);
+        }
+        if (release_threshold >= 0) {
+            printf("Free blocks of %ld bytes or more give back idle pages\n",
+                   release_threshold);
+        }
+        if (sized_mode) {
+            printf("Free and realloc are passed the block sizes\n");
+        }
     }
 #endif
 
@@ -528,6 +752,8 @@ int main(int argc, char **argv) {
 
     run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
               &speed_params);
+    if (latency_csv != NULL)
+        fclose(latency_csv);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -744,9 +970,10 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, size)) {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      (void *)lo, (void *)hi, (void *)mem_heap_lo(),
                      (void *)mem_heap_hi());
@@ -940,10 +1167,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    unsigned int index;
+    unsigned int index, count, align;
     size_t size;
     unsigned int max_index = 0;
     unsigned int op_index;
+    unsigned int blocks = 0; /* blocks in batches beyond one per request */
     int ignore = 0;
 
     if (verbose > 1)
@@ -952,6 +1180,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Allocate the trace record */
     if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
+    trace->num_aligned = 0;
 
     /* Read the trace file header */
     strcpy(trace->filename, tracedir);
@@ -1014,6 +1243,39 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'A':
+            ignore += fscanf(tracefile, "%u %u %lu", &index, &count, &size);
+            if (count == 0)
+                app_error("Empty batch in tracefile %s\n", trace->filename);
+            trace->ops[op_index].type = ALLOC_BATCH;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].count = count;
+            trace->ops[op_index].size = size;
+            index += count - 1;
+            max_index = (index > max_index) ? index : max_index;
+            blocks += count - 1;
+            break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %u %lu", &index, &align, &size);
+            if (align == 0 || (align & (align - 1)) != 0)
+                app_error("Bad alignment %u in tracefile %s\n", align,
+                          trace->filename);
+            trace->ops[op_index].type = ALLOC_ALIGNED;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].align = align;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            trace->num_aligned++;
+            break;
+        case 'F':
+            ignore += fscanf(tracefile, "%u %u", &index, &count);
+            if (count == 0)
+                app_error("Empty batch in tracefile %s\n", trace->filename);
+            trace->ops[op_index].type = FREE_BATCH;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].count = count;
+            blocks += count - 1;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
@@ -1029,7 +1291,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+    stats->ops = trace->num_ops + blocks; /* each block of a batch counts */
 
     return trace;
 }
@@ -1132,6 +1394,24 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             randomize_block(trace, index);
             break;
 
+        case ALLOC_ALIGNED: /* mm_memalign */
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+            if ((uintptr_t)p % trace->ops[i].align != 0) {
+                malloc_error(trace, i,
+                             "Payload address (%p) not aligned to %u bytes",
+                             (void *)p, trace->ops[i].align);
+                return false;
+            }
+            if (add_range(ranges, p, size, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             if (!check_index(trace, i, index)) {
                 allCheck = false;
@@ -1140,7 +1420,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
             /* Call the student's realloc */
             oldp = trace->blocks[index];
             setUBCheck(false);
-            newp = mm_realloc(oldp, size);
+            if (sized_mode)
+                newp = mm_realloc_sized(oldp, trace->block_sizes[index], size);
+            else
+                newp = mm_realloc(oldp, size);
             setUBCheck(true);
             if ((newp == NULL) && (size != 0)) {
                 malloc_error(trace, i, "mm_realloc failed.");
@@ -1192,7 +1475,39 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (sized_mode && p != NULL)
+                mm_free_sized(p, trace->block_sizes[index]);
+            else
+                mm_free(p);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            if (mm_malloc_batch(size, trace->ops[i].count,
+                                (void **)&trace->blocks[index]) !=
+                trace->ops[i].count) {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+            for (unsigned int k = index; k < index + trace->ops[i].count;
+                 k++) {
+                if (add_range(ranges, trace->blocks[k], size, trace, i, k) ==
+                    0)
+                    return false;
+                trace->block_sizes[k] = size;
+                randomize_block(trace, k);
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            for (unsigned int k = index; k < index + trace->ops[i].count;
+                 k++) {
+                if (!check_index(trace, i, k)) {
+                    allCheck = false;
+                }
+                remove_range(ranges, trace->blocks[k]);
+            }
+            /* The freed ids' pointers are dead, so they may be reordered */
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
             break;
 
         default:
@@ -1207,15 +1522,20 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges) {
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   Utilization is the ratio hwm/footprint, where footprint is the
+ *   most memory the heap and any regions mapped with mem_map() held
+ *   together while the student's malloc package ran the trace.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   If padded is set, aligned requests are made with malloc instead,
+ *   padded by the alignment as a caller without mm_memalign would have to,
+ *   to show what the alignment would otherwise waste.
+ *
+ *   In verbose mode, the resident bytes and the heap size are sampled
+ *   every RESIDENT_PERIOD requests, and their peaks and averages printed.
  */
-static double eval_mm_util(trace_t *trace, size_t tracenum) {
+static double eval_mm_util(trace_t *trace, size_t tracenum, bool padded) {
     unsigned int i;
     unsigned int index;
     size_t size, newsize, oldsize;
@@ -1223,6 +1543,10 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
     size_t total_size = 0;
     char *p;
     char *newp, *oldp;
+    bool sample = verbose > 1 && !padded;
+    size_t samples = 0;
+    size_t resident, max_resident = 0, heap, max_heap = 0;
+    double sum_resident = 0, sum_heap = 0;
 
     reinit_trace(trace);
 
@@ -1257,7 +1581,11 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
 
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0) {
+            if (sized_mode)
+                newp = mm_realloc_sized(oldp, oldsize, newsize);
+            else
+                newp = mm_realloc(oldp, newsize);
+            if (newp == NULL && newsize != 0) {
                 app_error("trace %zd: mm_realloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1280,11 +1608,54 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (sized_mode && p != NULL)
+                mm_free_sized(p, size);
+            else
+                mm_free(p);
 
             total_size -= size;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (mm_malloc_batch(size, trace->ops[i].count,
+                                (void **)&trace->blocks[index]) !=
+                trace->ops[i].count) {
+                app_error("trace %zd: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+            for (unsigned int k = index; k < index + trace->ops[i].count; k++)
+                trace->block_sizes[k] = size;
+
+            total_size += size * trace->ops[i].count;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            for (unsigned int k = index; k < index + trace->ops[i].count; k++)
+                total_size -= trace->block_sizes[k];
+
+            mm_free_batch((void **)&trace->blocks[index], trace->ops[i].count);
+            break;
+
+        case ALLOC_ALIGNED: /* mm_memalign, or a padded mm_malloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (padded && trace->ops[i].align > ALIGNMENT)
+                p = mm_malloc(size + trace->ops[i].align - ALIGNMENT);
+            else
+                p = mm_memalign(trace->ops[i].align, size);
+            if (p == NULL) {
+                app_error("trace %zd: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         default:
             app_error("trace %zd: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1293,9 +1664,29 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
         /* update the high-water mark */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
+
+        if (sample &&
+            (i % RESIDENT_PERIOD == 0 || i + 1 == trace->num_ops)) {
+            resident = mem_resident();
+            heap = mem_heapsize() + mem_mapped_size();
+            max_resident = resident > max_resident ? resident : max_resident;
+            max_heap = heap > max_heap ? heap : max_heap;
+            sum_resident += (double)resident;
+            sum_heap += (double)heap;
+            samples++;
+        }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (sample) {
+        mm_stats(&util_stats);
+        printf(" (%zu realloc copies avoided)", mm_realloc_copies_avoided());
+        printf(" (resident peak %zu, average %.0f bytes;"
+               " heap peak %zu, average %.0f bytes)",
+               max_resident, sum_resident / (double)samples, max_heap,
+               sum_heap / (double)samples);
+    }
+
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 /*
@@ -1303,9 +1694,6 @@ static double eval_mm_util(trace_t *trace, size_t tracenum) {
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr) {
-    unsigned int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1315,41 +1703,570 @@ static void eval_mm_speed(void *ptr) {
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type) {
+    replay_ops(trace->ops, trace->num_ops, trace->blocks,
+               sized_mode ? trace->block_sizes : NULL, NULL, NULL);
+}
+
+/*
+ * eval_mm_latency - replay a trace once more, timing every request into a
+ * histogram per request type. Kept apart from eval_mm_speed so that
+ * reading the clock does not weigh on the throughput measurement.
+ */
+static void eval_mm_latency(trace_t *trace, hist_t *hists) {
+    reinit_trace(trace);
+    memset(hists, 0, NUM_OP_TYPES * sizeof(hist_t));
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    replay_ops(trace->ops, trace->num_ops, trace->blocks,
+               sized_mode ? trace->block_sizes : NULL, NULL, hists);
+}
+
+/*
+ * handoff_push - Give a block to the consumer, waiting while the ring is
+ *    full
+ */
+static void handoff_push(handoff_t *queue, char *block) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) ==
+           HANDOFF_SLOTS)
+        sched_yield();
+    queue->slots[tail % HANDOFF_SLOTS] = block;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * hist_bucket - Bucket of the histogram a latency falls in
+ */
+static size_t hist_bucket(uint64_t ticks) {
+    if (ticks < HIST_SUB)
+        return (size_t)ticks;
+    unsigned int log2 = 63 - (unsigned int)__builtin_clzll(ticks);
+    size_t sub = (size_t)(ticks >> (log2 - HIST_SUB_LOG2)) & (HIST_SUB - 1);
+    return (log2 - HIST_SUB_LOG2 + 1) * HIST_SUB + sub;
+}
+
+/*
+ * hist_bucket_lo - Smallest latency falling in a bucket
+ */
+static uint64_t hist_bucket_lo(size_t bucket) {
+    if (bucket < HIST_SUB)
+        return bucket;
+    size_t group = bucket / HIST_SUB;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (group - 1);
+}
+
+/*
+ * hist_bucket_hi - Largest latency falling in a bucket
+ */
+static uint64_t hist_bucket_hi(size_t bucket) {
+    if (bucket < HIST_SUB)
+        return bucket;
+    return hist_bucket_lo(bucket) + ((uint64_t)1 << (bucket / HIST_SUB - 1)) -
+           1;
+}
+
+/*
+ * hist_record - Count one request of the given latency
+ */
+static void hist_record(hist_t *hist, uint64_t ticks) {
+    hist->count[hist_bucket(ticks)]++;
+    hist->total++;
+    hist->sum += ticks;
+    if (ticks > hist->max)
+        hist->max = ticks;
+}
+
+/*
+ * hist_quantile - Latency at or below which a fraction q of the recorded
+ *    requests fall, rounded up to the top of its bucket
+ */
+static uint64_t hist_quantile(const hist_t *hist, double q) {
+    unsigned long rank = (unsigned long)ceil(q * (double)hist->total);
+    unsigned long seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist->count[b];
+        if (seen >= rank) {
+            uint64_t hi = hist_bucket_hi(b);
+            return hi < hist->max ? hi : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/*
+ * replay_ops - Run trace requests against the mm package without any
+ *    checking.  blocks holds the current pointer for each id.  If sizes
+ *    is set, it tracks each id's size and frees and reallocs go through
+ *    the sized entry points.  If queue is set, blocks are handed to its
+ *    consumer instead of being freed.  If hists is set, each request is
+ *    timed into the histogram of its type.
+ */
+static void replay_ops(const traceop_t *ops, unsigned int num_ops,
+                       char **blocks, size_t *sizes, handoff_t *queue,
+                       hist_t *hists) {
+    unsigned int i, index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+    uint64_t start = 0;
+
+    for (i = 0; i < num_ops; i++) {
+        if (hists != NULL)
+            start = read_ticks();
+        switch (ops[i].type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = ops[i].index;
+            size = ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+                app_error("mm_malloc error in replay_ops");
+            blocks[index] = p;
+            if (sizes != NULL)
+                sizes[index] = size;
+            break;
+
+        case ALLOC_ALIGNED: /* mm_memalign */
+            index = ops[i].index;
+            size = ops[i].size;
+            if ((p = mm_memalign(ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in replay_ops");
+            blocks[index] = p;
+            if (sizes != NULL)
+                sizes[index] = size;
             break;
 
         case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
+            index = ops[i].index;
+            newsize = ops[i].size;
+            oldp = blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
+            if (sizes != NULL) {
+                newp = mm_realloc_sized(oldp, sizes[index], newsize);
+                sizes[index] = newsize;
+            } else {
+                newp = mm_realloc(oldp, newsize);
+            }
+            if (newp == NULL && newsize != 0)
+                app_error("mm_realloc error in replay_ops");
             setUBCheck(true);
-            trace->blocks[index] = newp;
+            blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = ops[i].index;
             if (index == (unsigned int)-1) {
                 block = 0;
             } else {
-                block = trace->blocks[index];
+                block = blocks[index];
+            }
+            if (queue != NULL && block != NULL)
+                handoff_push(queue, block);
+            else if (sizes != NULL && block != NULL)
+                mm_free_sized(block, sizes[index]);
+            else
+                mm_free(block);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = ops[i].index;
+            if (mm_malloc_batch(ops[i].size, ops[i].count,
+                                (void **)&blocks[index]) != ops[i].count)
+                app_error("mm_malloc_batch error in replay_ops");
+            if (sizes != NULL)
+                for (unsigned int k = index; k < index + ops[i].count; k++)
+                    sizes[k] = ops[i].size;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = ops[i].index;
+            if (queue != NULL) {
+                for (unsigned int k = index; k < index + ops[i].count; k++)
+                    handoff_push(queue, blocks[k]);
+            } else {
+                mm_free_batch((void **)&blocks[index], ops[i].count);
             }
-            mm_free(block);
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in replay_ops");
+        }
+        if (hists != NULL)
+            hist_record(&hists[ops[i].type], read_ticks() - start);
+    }
+}
+
+/*
+ * wall_secs - Read a monotonic wall clock, in seconds
+ */
+static double wall_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+ * replay_thread - Thread body of a threaded replay
+ */
+static void *replay_thread(void *ptr) {
+    replay_t *unit = (replay_t *)ptr;
+    pthread_barrier_wait(unit->start);
+    unit->started = wall_secs();
+    replay_ops(unit->ops, unit->num_ops, unit->blocks, NULL, unit->queue,
+               NULL);
+    unit->secs = wall_secs() - unit->started;
+    if (unit->queue != NULL)
+        atomic_store_explicit(&unit->queue->done, true, memory_order_release);
+    mm_thread_detach();
+    return NULL;
+}
+
+/*
+ * consumer_thread - Thread body freeing the blocks a producer hands over
+ */
+static void *consumer_thread(void *ptr) {
+    handoff_t *queue = (handoff_t *)ptr;
+    pthread_barrier_wait(queue->start);
+    queue->started = wall_secs();
+    size_t head = 0;
+    for (;;) {
+        if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+            /* done is set after the last push, so recheck the tail */
+            if (atomic_load_explicit(&queue->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&queue->tail,
+                                             memory_order_acquire))
+                break;
+            sched_yield();
+            continue;
+        }
+        mm_free(queue->slots[head % HANDOFF_SLOTS]);
+        atomic_store_explicit(&queue->head, ++head, memory_order_release);
+    }
+    queue->secs = wall_secs() - queue->started;
+    mm_thread_detach();
+    return NULL;
+}
+
+/*
+ * make_units - Divide the traces into n units of replay work.  With a
+ *    single trace, unit k holds its requests on ids equal to k modulo n,
+ *    in trace order, with batch requests split into single ones.
+ *    Otherwise unit k is all of trace k modulo num_traces.
+ */
+static replay_t *make_units(trace_t **traces, size_t num_traces,
+                            unsigned int n) {
+    replay_t *units = (replay_t *)calloc(n, sizeof(replay_t));
+    if (units == NULL)
+        unix_error("calloc failed in make_units");
+
+    for (unsigned int k = 0; k < n; k++) {
+        trace_t *trace = traces[num_traces == 1 ? 0 : k % num_traces];
+        unsigned int max_ops = trace->num_ops;
+        for (unsigned int i = 0; i < trace->num_ops; i++) {
+            if (trace->ops[i].type == ALLOC_BATCH ||
+                trace->ops[i].type == FREE_BATCH)
+                max_ops += trace->ops[i].count - 1;
+        }
+        units[k].ops = (traceop_t *)malloc(max_ops * sizeof(traceop_t));
+        units[k].blocks = (char **)calloc(trace->num_ids, sizeof(char *));
+        if (units[k].ops == NULL || units[k].blocks == NULL)
+            unix_error("malloc failed in make_units");
+        units[k].num_ids = trace->num_ids;
+
+        for (unsigned int i = 0; i < trace->num_ops; i++) {
+            traceop_t op = trace->ops[i];
+            bool batch = (op.type == ALLOC_BATCH || op.type == FREE_BATCH);
+            if (num_traces > 1 || n == 1) {
+                units[k].ops[units[k].num_ops++] = op;
+                units[k].num_blocks += batch ? op.count : 1;
+                continue;
+            }
+            if (!batch) {
+                if (op.index % n == k) {
+                    units[k].ops[units[k].num_ops++] = op;
+                    units[k].num_blocks++;
+                }
+                continue;
+            }
+            /* A batch spans the units, so split it into single requests */
+            unsigned int first = op.index, last = op.index + op.count - 1;
+            op.type = (op.type == ALLOC_BATCH) ? ALLOC : FREE;
+            for (op.index = first; op.index <= last; op.index++) {
+                if (op.index % n == k) {
+                    units[k].ops[units[k].num_ops++] = op;
+                    units[k].num_blocks++;
+                }
+            }
+        }
+    }
+    return units;
+}
+
+/*
+ * read_traces - Read every trace file named for a threaded replay
+ */
+static trace_t **read_traces(void) {
+    trace_t **traces =
+        (trace_t **)malloc(num_global_tracefiles * sizeof(trace_t *));
+    if (traces == NULL)
+        unix_error("malloc failed in read_traces");
+    for (size_t i = 0; i < num_global_tracefiles; i++) {
+        stats_t stats;
+        traces[i] = read_trace(&stats, tracedir, global_tracefiles[i]);
+    }
+    return traces;
+}
+
+/*
+ * free_traces - Free the traces read by read_traces
+ */
+static void free_traces(trace_t **traces) {
+    for (size_t i = 0; i < num_global_tracefiles; i++)
+        free_trace(traces[i]);
+    free(traces);
+}
+
+/*
+ * run_units - Replay n units against a fresh heap, each on its own thread
+ *    if parallel is set and one after the other otherwise.  Returns the
+ *    elapsed wall-clock time.
+ */
+static double run_units(replay_t *units, unsigned int n, bool parallel) {
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in run_units");
+    for (unsigned int k = 0; k < n; k++)
+        memset(units[k].blocks, 0, units[k].num_ids * sizeof(char *));
+
+    if (!parallel) {
+        double start = wall_secs();
+        for (unsigned int k = 0; k < n; k++) {
+            double unit_start = wall_secs();
+            replay_ops(units[k].ops, units[k].num_ops, units[k].blocks, NULL,
+                       NULL, NULL);
+            units[k].secs = wall_secs() - unit_start;
+        }
+        return wall_secs() - start;
+    }
+
+    pthread_barrier_t barrier;
+    pthread_t *tids = (pthread_t *)malloc(n * sizeof(pthread_t));
+    if (tids == NULL)
+        unix_error("malloc failed in run_units");
+    pthread_barrier_init(&barrier, NULL, n + 1);
+    for (unsigned int k = 0; k < n; k++) {
+        units[k].start = &barrier;
+        if (pthread_create(&tids[k], NULL, replay_thread, &units[k]) != 0)
+            unix_error("pthread_create failed in run_units");
+    }
+
+    /* Time from the first thread starting to the last one finishing */
+    pthread_barrier_wait(&barrier);
+    double start = DBL_MAX, end = 0;
+    for (unsigned int k = 0; k < n; k++) {
+        pthread_join(tids[k], NULL);
+        if (units[k].started < start)
+            start = units[k].started;
+        if (units[k].started + units[k].secs > end)
+            end = units[k].started + units[k].secs;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(tids);
+    return end - start;
+}
+
+/*
+ * eval_mm_scaling - Replay the traces on 1 to max_threads threads sharing
+ *    one heap, and report aggregate and per-thread throughput.  Speedup
+ *    is against replaying the same units one after the other on a single
+ *    thread, and efficiency is speedup per thread.  Each measurement is
+ *    the best of SCALING_REPS runs.
+ */
+static void eval_mm_scaling(unsigned int max_threads) {
+    const int reps = SCALING_REPS;
+    trace_t **traces = read_traces();
+
+    mem_init(false);
+    if (num_global_tracefiles == 1) {
+        printf("Threaded replay of %s, split by id over the threads\n",
+               traces[0]->filename);
+    } else {
+        printf("Threaded replay of %zu traces, one per thread\n",
+               num_global_tracefiles);
+    }
+    printf("%7s %10s %8s %10s  %s\n", "threads", "Kops/s", "speedup",
+           "efficiency", "per-thread Kops/s");
+
+    double *thread_secs = (double *)malloc(max_threads * sizeof(double));
+    if (thread_secs == NULL)
+        unix_error("malloc failed in eval_mm_scaling");
+
+    for (unsigned int n = 1; n <= max_threads; n++) {
+        replay_t *units = make_units(traces, num_global_tracefiles, n);
+        double ops = 0;
+        for (unsigned int k = 0; k < n; k++)
+            ops += units[k].num_blocks;
+
+        double serial = DBL_MAX, parallel = DBL_MAX;
+        for (int r = 0; r < reps; r++) {
+            double secs = run_units(units, n, false);
+            if (secs < serial)
+                serial = secs;
+        }
+        for (int r = 0; r < reps; r++) {
+            double secs = run_units(units, n, true);
+            if (secs < parallel) {
+                parallel = secs;
+                for (unsigned int k = 0; k < n; k++)
+                    thread_secs[k] = units[k].secs;
+            }
+        }
+        if (!mm_checkheap(__LINE__)) {
+            printf("Heap check failed after replay on %u threads\n", n);
+            errors++;
+        }
+
+        double speedup = serial / parallel;
+        printf("%7u %10.0f %8.2f %9.1f%% ", n, ops / (parallel * 1000.0),
+               speedup, 100.0 * speedup / n);
+        for (unsigned int k = 0; k < n; k++)
+            printf(" %.0f", units[k].num_blocks / (thread_secs[k] * 1000.0));
+        printf("\n");
+
+        for (unsigned int k = 0; k < n; k++) {
+            free(units[k].ops);
+            free(units[k].blocks);
+        }
+        free(units);
+    }
+
+    free(thread_secs);
+    free_traces(traces);
+    mem_deinit();
+}
+
+/*
+ * run_pairs - Replay n units against a fresh heap, each on a producer
+ *    thread that hands every block it frees to a consumer thread of its
+ *    own.  Returns the elapsed wall-clock time.
+ */
+static double run_pairs(replay_t *units, handoff_t *queues, unsigned int n) {
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in run_pairs");
+
+    pthread_barrier_t barrier;
+    pthread_t *tids = (pthread_t *)malloc(2 * n * sizeof(pthread_t));
+    if (tids == NULL)
+        unix_error("malloc failed in run_pairs");
+    pthread_barrier_init(&barrier, NULL, 2 * n + 1);
+    for (unsigned int k = 0; k < n; k++) {
+        memset(units[k].blocks, 0, units[k].num_ids * sizeof(char *));
+        atomic_store(&queues[k].head, 0);
+        atomic_store(&queues[k].tail, 0);
+        atomic_store(&queues[k].done, false);
+        units[k].queue = &queues[k];
+        units[k].start = queues[k].start = &barrier;
+        if (pthread_create(&tids[2 * k], NULL, replay_thread, &units[k]) != 0 ||
+            pthread_create(&tids[2 * k + 1], NULL, consumer_thread,
+                           &queues[k]) != 0)
+            unix_error("pthread_create failed in run_pairs");
+    }
+
+    /* Time from the first thread starting to the last one finishing */
+    pthread_barrier_wait(&barrier);
+    double start = DBL_MAX, end = 0;
+    for (unsigned int k = 0; k < n; k++) {
+        pthread_join(tids[2 * k], NULL);
+        pthread_join(tids[2 * k + 1], NULL);
+        units[k].queue = NULL;
+        if (units[k].started < start)
+            start = units[k].started;
+        if (queues[k].started < start)
+            start = queues[k].started;
+        if (units[k].started + units[k].secs > end)
+            end = units[k].started + units[k].secs;
+        if (queues[k].started + queues[k].secs > end)
+            end = queues[k].started + queues[k].secs;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(tids);
+    return end - start;
+}
+
+/*
+ * eval_mm_pipeline - Replay the traces as 1 to max_pairs producer/consumer
+ *    pairs sharing one heap, where each producer's frees are carried out
+ *    by its consumer.  Throughput is compared with the same units
+ *    replayed on as many threads freeing their own blocks.  Each
+ *    measurement is the best of SCALING_REPS runs.
+ */
+static void eval_mm_pipeline(unsigned int max_pairs) {
+    const int reps = SCALING_REPS;
+    trace_t **traces = read_traces();
+
+    handoff_t *queues = (handoff_t *)calloc(max_pairs, sizeof(handoff_t));
+    if (queues == NULL)
+        unix_error("calloc failed in eval_mm_pipeline");
+    for (unsigned int k = 0; k < max_pairs; k++) {
+        queues[k].slots = (char **)malloc(HANDOFF_SLOTS * sizeof(char *));
+        if (queues[k].slots == NULL)
+            unix_error("malloc failed in eval_mm_pipeline");
+    }
+
+    mem_init(false);
+    if (num_global_tracefiles == 1) {
+        printf("Producer/consumer replay of %s, split by id over the pairs\n",
+               traces[0]->filename);
+    } else {
+        printf("Producer/consumer replay of %zu traces, one per pair\n",
+               num_global_tracefiles);
+    }
+    printf("%7s %10s %13s %9s\n", "pairs", "Kops/s", "local Kops/s",
+           "relative");
+
+    for (unsigned int n = 1; n <= max_pairs; n++) {
+        replay_t *units = make_units(traces, num_global_tracefiles, n);
+        double ops = 0;
+        for (unsigned int k = 0; k < n; k++)
+            ops += units[k].num_blocks;
+
+        double local = DBL_MAX, piped = DBL_MAX;
+        for (int r = 0; r < reps; r++) {
+            double secs = run_units(units, n, true);
+            if (secs < local)
+                local = secs;
+        }
+        for (int r = 0; r < reps; r++) {
+            double secs = run_pairs(units, queues, n);
+            if (secs < piped)
+                piped = secs;
         }
+        if (!mm_checkheap(__LINE__)) {
+            printf("Heap check failed after replay on %u pairs\n", n);
+            errors++;
+        }
+
+        printf("%7u %10.0f %13.0f %8.1f%%\n", n, ops / (piped * 1000.0),
+               ops / (local * 1000.0), 100.0 * local / piped);
+
+        for (unsigned int k = 0; k < n; k++) {
+            free(units[k].ops);
+            free(units[k].blocks);
+        }
+        free(units);
+    }
+
+    for (unsigned int k = 0; k < max_pairs; k++)
+        free(queues[k].slots);
+    free(queues);
+    free_traces(traces);
+    mem_deinit();
 }
 
 /*
@@ -1376,6 +2293,15 @@ static bool eval_libc_valid(trace_t *trace) {
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case ALLOC_ALIGNED: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+                NULL) {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1394,6 +2320,21 @@ static bool eval_libc_valid(trace_t *trace) {
             }
             break;
 
+        case ALLOC_BATCH: /* one malloc per block */
+            for (unsigned int k = 0; k < trace->ops[i].count; k++) {
+                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index + k] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            for (unsigned int k = 0; k < trace->ops[i].count; k++)
+                free(trace->blocks[trace->ops[i].index + k]);
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1426,6 +2367,14 @@ static void eval_libc_speed(void *ptr) {
             trace->blocks[index] = p;
             break;
 
+        case ALLOC_ALIGNED: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1445,6 +2394,25 @@ static void eval_libc_speed(void *ptr) {
                 free(0);
             }
             break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            for (unsigned int k = 0; k < trace->ops[i].count; k++) {
+                if ((p = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[index + k] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            index = trace->ops[i].index;
+            for (unsigned int k = 0; k < trace->ops[i].count; k++)
+                free(trace->blocks[index + k]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_libc_speed");
         }
     }
 }
@@ -1453,6 +2421,61 @@ static void eval_libc_speed(void *ptr) {
  * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * print_mm_stats - prints the statistics mm_stats reported for a trace:
+ * sizes, event counts, and the free bytes and blocks of each non-empty
+ * seglist.
+ */
+static void print_mm_stats(const struct mm_stats *stats) {
+    printf("  heap %zu, mapped %zu, live %zu, reserved %zu, quick %zu, "
+           "largest free %zu bytes\n",
+           stats->heap_size, stats->mapped_size, stats->live_bytes,
+           stats->reserve_bytes, stats->quick_bytes, stats->largest_free);
+    printf("  %zu splits, %zu coalesces, %zu heap extensions, "
+           "%zu fit probes\n",
+           stats->splits, stats->coalesces, stats->heap_extends,
+           stats->fit_probes);
+    printf("  free bytes (blocks):");
+    for (size_t i = 0; i < MM_STATS_BUCKETS; i++) {
+        if (stats->fcounts[i] > 0)
+            printf(" %zu:%zu(%zu)", i, stats->free_bytes[i],
+                   stats->fcounts[i]);
+    }
+    printf(" tree:%zu(%zu)\n", stats->tree_bytes, stats->tree_count);
+}
+
+/*
+ * print_latency - prints the latency percentiles of each request type the
+ * trace issued, in ticks of read_ticks, and dumps the histograms as CSV
+ * rows of trace, type, bucket bounds and count if asked to.
+ */
+static void print_latency(const trace_t *trace, const hist_t *hists) {
+    if (verbose == 1)
+        putchar('\n'); /* end the progress line */
+    printf("  %-12s %10s %8s %8s %8s %8s %8s %10s  (ticks)\n", "latency",
+           "ops", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (size_t t = 0; t < NUM_OP_TYPES; t++) {
+        const hist_t *hist = &hists[t];
+        if (hist->total == 0)
+            continue;
+        printf("  %-12s %10lu %8.1f %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+               " %8" PRIu64 " %10" PRIu64 "\n",
+               op_names[t], hist->total,
+               (double)hist->sum / (double)hist->total,
+               hist_quantile(hist, 0.5), hist_quantile(hist, 0.9),
+               hist_quantile(hist, 0.99), hist_quantile(hist, 0.999),
+               hist->max);
+        if (latency_csv == NULL)
+            continue;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            if (hist->count[b] > 0)
+                fprintf(latency_csv, "%s,%s,%" PRIu64 ",%" PRIu64 ",%lu\n",
+                        trace->filename, op_names[t], hist_bucket_lo(b),
+                        hist_bucket_hi(b), hist->count[b]);
+        }
+    }
+}
+
 /*
  * printresults - prints a performance summary for some malloc package and
  * returns a summary of the stats to the caller.
@@ -1800,7 +2823,10 @@ static double measure_ref_throughput(bool checkpoint) {
  * usage - Explain the command line arguments
  */
 static void usage(char *prog) {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlVCdDSL] [-f <file>] [-F <n>] [-R <pct>] [-K <n>] "
+            "[-M <n>] [-G <n>] [-P <n>] [-Q <n>] [-H <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -1814,5 +2840,25 @@ static void usage(char *prog) {
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-S         Pass known block sizes to free and "
+                    "realloc.\n");
+    fprintf(stderr, "\t-L         Report request latency percentiles "
+                    "per trace (release driver only).\n");
+    fprintf(stderr, "\t-H <file>  As -L, and dump the latency histograms "
+                    "to <file> as CSV.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-F <n>     Examine up to <n> free blocks per fit "
+                    "search.\n");
+    fprintf(stderr, "\t-R <pct>   Reserve <pct>%% slack behind blocks "
+                    "realloc keeps growing.\n");
+    fprintf(stderr, "\t-K <n>     Keep up to <n> freed bytes uncoalesced "
+                    "for reuse (0 = off).\n");
+    fprintf(stderr, "\t-M <n>     Map requests of <n> bytes or more apart "
+                    "from the heap (0 = off).\n");
+    fprintf(stderr, "\t-G <n>     Give back idle pages of free blocks of <n> "
+                    "bytes or more (0 = off).\n");
+    fprintf(stderr, "\t-P <n>     Replay the traces on 1 to <n> threads and "
+                    "report scaling.\n");
+    fprintf(stderr, "\t-Q <n>     Replay the traces as 1 to <n> "
+                    "producer/consumer pairs.\n");
 }
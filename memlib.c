@@ -24,8 +24,18 @@
  * Loading from the sparse emulation uses the above lookup and then aggregates
  *  the data into a return value.
  *
+ * Regions handed out by mem_map are carved downward from the top of the
+ *  space the heap may grow into, and are emulated just like the heap.
+ *
+ * Pages of the heap or of a region that the allocator no longer needs may
+ *  be discarded with mem_discard, a model of madvise(MADV_DONTNEED).  They
+ *  stay part of the footprint but stop being resident, which mem_resident
+ *  measures: in dense mode by asking the system with mincore, in sparse
+ *  mode by counting the emulation pages in use.
+ *
  * If an emulated access is made to an address outside of the current
- *  bounds (mem_heap_lo, mem_heap_hi), then the address is assumed to be to
+ *  bounds (mem_heap_lo, mem_heap_hi) and of the mapped regions, then the
+ *  address is assumed to be to
  *  a non-heap location, such as stack, global variables, etc.  For some
  *  implementations, this access is meant to be to the heap and was "safe"
  *  in non-emulation, as it was to the same page as actual heap data.  But
@@ -33,9 +43,11 @@
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
  */
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* madvise and mincore */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -69,20 +81,38 @@ typedef struct MBLK {
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A range of region space below the top that is not mapped */
+typedef struct region_hole {
+    unsigned char *lo;        /* First byte of the hole */
+    unsigned char *hi;        /* One past its last byte */
+    struct region_hole *next; /* Next hole up */
+} region_hole_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_dirty;    /* Highest break since mem_init */
+static unsigned char *mem_peak;     /* Highest break since last reset */
+static size_t mem_released = 0;     /* Bytes given back since last reset */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static unsigned char *region_floor; /* Lowest mapped region address */
+static region_hole_t *region_holes = NULL; /* Holes above it, by address */
+static size_t mem_mapped = 0;       /* Bytes mapped in regions */
+static size_t mem_peak_total = 0;   /* Most heap + region bytes since reset */
+static int dev_zero = -1;           /* Source of zero pages */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
+/* Guards the break, so that threads may call mem_sbrk concurrently */
+static pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
+static mem_block_t *released_pages = NULL; /* Pages freed by shrinking */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
@@ -116,7 +146,15 @@ const char *__msan_default_options(void) {
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
+static void release_pages(unsigned char *lo, unsigned char *hi);
+static void zero_dense(unsigned char *lo, unsigned char *hi);
+static void clear_regions(bool zero);
+static void note_footprint(void);
+static void *map_region(size_t size, bool counted);
+static void unmap_region(void *addr, size_t size, bool counted);
 static void print_stats(void);
+static bool emulated(const void *addr, size_t len);
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi);
 
 /*
  * mem_init - initialize the memory system model
@@ -145,7 +183,8 @@ void mem_init(bool do_sparse) {
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
+    if (dev_zero < 0)
+        dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     void *addr = mmap(start,                  /* suggested start*/
                       mmap_length,            /* length */
@@ -168,6 +207,13 @@ void mem_init(bool do_sparse) {
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_dirty = heap;
+    mem_peak = heap;
+    mem_released = 0;
+    released_pages = NULL;
+    region_floor = mem_max_addr;
+    mem_mapped = 0;
+    mem_peak_total = 0;
 }
 
 /*
@@ -175,8 +221,10 @@ void mem_init(bool do_sparse) {
  */
 void mem_deinit(void) {
     print_stats();
+    clear_regions(false);
     munmap(heap, mmap_length);
     next_free_page = NULL;
+    released_pages = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
@@ -193,6 +241,7 @@ void mem_reset_brk(void) {
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
+        released_pages = NULL;
         num_free_pages = num_pages;
     } else {
 #ifdef USE_ASAN
@@ -208,25 +257,46 @@ void mem_reset_brk(void) {
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
     }
+    /* The page table is cleared already in sparse mode */
+    clear_regions(!sparse);
     mem_brk = heap;
+    mem_peak = heap;
+    mem_released = 0;
+    mem_peak_total = 0;
 }
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
- *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * sbrk_locked - mem_sbrk with brk_lock held
  */
-void *mem_sbrk(intptr_t incr) {
+static void *sbrk_locked(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && mem_brk - heap < -incr) {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, below its start\n",
+                (long)-incr);
+    } else if (incr < 0) {
+        /*
+         * Shrinking only moves mem_brk.  In dense mode the range above the
+         * new break is neither released nor marked: its pages stay mapped
+         * and keep their contents.  mem_dirty still lies above them, so
+         * growing into them again zeroes them first, and they read as
+         * zero.  Sparse pages wholly above the new break are released.
+         * The process break that dense growth raises is not lowered.
+         */
+        unsigned char *new_brk = mem_brk + incr;
+#ifdef USE_ASAN
+        __asan_poison_memory_region(new_brk, (size_t)-incr);
+#endif
+        if (sparse)
+            release_pages(new_brk, mem_brk);
+        mem_released += (size_t)-incr;
+        mem_brk = new_brk;
+        return (void *)old_brk;
+    } else if (incr > region_floor - mem_brk) {
         ok = false;
         ptrdiff_t alloc = mem_brk - heap + incr;
         fprintf(stderr,
@@ -248,7 +318,22 @@ void *mem_sbrk(intptr_t incr) {
         /* Mark the extended section of the heap as addressable */
         __asan_unpoison_memory_region(mem_brk, (size_t)incr);
 #endif
+        if (!sparse && mem_brk < mem_dirty) {
+            size_t len = (size_t)(mem_dirty - mem_brk);
+            if (len > (size_t)incr)
+                len = (size_t)incr;
+            zero_dense(mem_brk, mem_brk + len);
+#ifdef USE_MSAN
+            /* Clearing must not hide reads of uninitialized memory */
+            __msan_allocated_memory(mem_brk, (size_t)incr);
+#endif
+        }
         mem_brk += incr;
+        if (mem_brk > mem_dirty)
+            mem_dirty = mem_brk;
+        if (mem_brk > mem_peak)
+            mem_peak = mem_brk;
+        note_footprint();
         return (void *)old_brk;
     } else {
         errno = ENOMEM;
@@ -256,6 +341,226 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mem_sbrk - simple model of the sbrk function. Extends the heap
+ *                by incr bytes and returns the start address of the new area.
+ * A negative incr shrinks the heap; sparse pages wholly above the new break
+ * are released for reuse, while dense ones are kept as they are.  The new
+ * area reads as zero:
+ * dense memory is zero when first mapped, so only the part below an earlier
+ * break needs clearing, and sparse pages are cleared as they are allocated.
+ * Safe to call from several threads at once in dense mode.
+ */
+void *mem_sbrk(intptr_t incr) {
+    pthread_mutex_lock(&brk_lock);
+    void *old_brk = sbrk_locked(incr);
+    pthread_mutex_unlock(&brk_lock);
+    return old_brk;
+}
+
+/*
+ * mem_map - model of an anonymous mmap: map a region of at least size bytes
+ * apart from the heap, reading as zero.  Regions are page-aligned and taken
+ * from the top of the space the heap grows into, reusing the holes left by
+ * mem_unmap first.  Returns NULL if no room is left.
+ */
+void *mem_map(size_t size) {
+    return map_region(size, true);
+}
+
+/*
+ * mem_map_scratch - mem_map for the allocator's checks: the region is left
+ * out of the mapped size and the peak footprint.
+ */
+void *mem_map_scratch(size_t size) {
+    return map_region(size, false);
+}
+
+/*
+ * map_region - mem_map, adding the region to mem_mapped if counted is set
+ */
+static void *map_region(size_t size, bool counted) {
+    size_t page = mem_pagesize();
+    if (size == 0 || size > SIZE_MAX - page)
+        return NULL;
+    size_t len = (size + page - 1) & ~(page - 1);
+
+    pthread_mutex_lock(&brk_lock);
+    unsigned char *lo = NULL;
+    region_hole_t **link = &region_holes;
+    while (*link && (size_t)((*link)->hi - (*link)->lo) < len)
+        link = &(*link)->next;
+    if (*link) {
+        /* Take the top of the first hole that is large enough */
+        region_hole_t *hole = *link;
+        hole->hi -= len;
+        lo = hole->hi;
+        if (hole->hi == hole->lo) {
+            *link = hole->next;
+            free(hole);
+        }
+    } else if (len <= (size_t)(region_floor - mem_brk)) {
+        region_floor -= len;
+        lo = region_floor;
+    }
+    if (lo != NULL) {
+#ifdef USE_ASAN
+        __asan_unpoison_memory_region(lo, len);
+#endif
+#ifdef USE_MSAN
+        __msan_allocated_memory(lo, len);
+#endif
+        if (counted) {
+            mem_mapped += len;
+            note_footprint();
+        }
+    } else {
+        errno = ENOMEM;
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return (void *)lo;
+}
+
+/*
+ * mem_unmap - model of munmap for a region returned by mem_map, with the
+ * size it was mapped with.  Its pages are given back, and read as zero if
+ * they are mapped again.
+ */
+void mem_unmap(void *addr, size_t size) {
+    unmap_region(addr, size, true);
+}
+
+/*
+ * mem_unmap_scratch - mem_unmap for a region from mem_map_scratch
+ */
+void mem_unmap_scratch(void *addr, size_t size) {
+    unmap_region(addr, size, false);
+}
+
+/*
+ * unmap_region - mem_unmap, taking the region off mem_mapped if counted is
+ * set
+ */
+static void unmap_region(void *addr, size_t size, bool counted) {
+    size_t page = mem_pagesize();
+    size_t len = (size + page - 1) & ~(page - 1);
+    unsigned char *lo = (unsigned char *)addr;
+    unsigned char *hi = lo + len;
+
+    pthread_mutex_lock(&brk_lock);
+    assert(lo >= region_floor && hi <= mem_max_addr);
+    if (sparse) {
+        release_pages(lo, hi);
+    } else {
+#ifdef USE_ASAN
+        __asan_poison_memory_region(lo, len);
+#endif
+        zero_dense(lo, hi);
+    }
+    if (counted)
+        mem_mapped -= len;
+
+    /* Add a hole, merging it with its neighbours */
+    region_hole_t **link = &region_holes;
+    while (*link && (*link)->hi < lo)
+        link = &(*link)->next;
+    region_hole_t *hole = *link;
+    if (hole && hole->hi == lo) {
+        hole->hi = hi;
+        region_hole_t *up = hole->next;
+        if (up && up->lo == hi) {
+            hole->hi = up->hi;
+            hole->next = up->next;
+            free(up);
+        }
+    } else if (hole && hole->lo == hi) {
+        hole->lo = lo;
+    } else {
+        region_hole_t *fresh = malloc(sizeof(region_hole_t));
+        if (fresh == NULL) {
+            /* The region just stays out of use */
+            pthread_mutex_unlock(&brk_lock);
+            return;
+        }
+        fresh->lo = lo;
+        fresh->hi = hi;
+        fresh->next = hole;
+        *link = fresh;
+    }
+
+    /* A hole at the bottom lifts the floor instead */
+    hole = region_holes;
+    if (hole->lo == region_floor) {
+        region_floor = hole->hi;
+        region_holes = hole->next;
+        free(hole);
+    }
+    pthread_mutex_unlock(&brk_lock);
+}
+
+/*
+ * mem_discard - model of madvise(MADV_DONTNEED): the whole pages in
+ * [addr, addr + size) are given back and read as zero from then on, but
+ * remain part of the heap or region holding them.  Parts of pages at
+ * either end are left alone.
+ */
+void mem_discard(void *addr, size_t size) {
+    size_t page = mem_pagesize();
+    uintptr_t start = ((uintptr_t)addr + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = ((uintptr_t)addr + size) & ~(uintptr_t)(page - 1);
+    if (end <= start)
+        return;
+    unsigned char *lo = (unsigned char *)start;
+    unsigned char *hi = (unsigned char *)end;
+
+    pthread_mutex_lock(&brk_lock);
+    assert(emulated(lo, (size_t)(hi - lo)));
+    if (sparse) {
+        release_pages(lo, hi);
+    } else {
+        zero_dense(lo, hi);
+#ifdef USE_MSAN
+        __msan_allocated_memory(lo, (size_t)(hi - lo));
+#endif
+    }
+    pthread_mutex_unlock(&brk_lock);
+}
+
+/*
+ * mem_resident - return the bytes of the heap and of the mapped regions
+ * currently backed by memory.  Dense mode asks the system which pages are
+ * resident; sparse mode counts the emulation pages in use.
+ */
+size_t mem_resident(void) {
+    pthread_mutex_lock(&brk_lock);
+    size_t bytes;
+    if (sparse) {
+        bytes = (num_pages - num_free_pages) * SPARSE_PAGE_SIZE;
+    } else {
+        bytes = resident_bytes(heap, mem_brk) +
+                resident_bytes(region_floor, mem_max_addr);
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return bytes;
+}
+
+/*
+ * mem_is_mapped - return whether [addr, addr + len) lies in mapped regions
+ */
+bool mem_is_mapped(const void *addr, size_t len) {
+    const unsigned char *lo = (const unsigned char *)addr;
+    const unsigned char *hi = lo + len;
+    pthread_mutex_lock(&brk_lock);
+    bool mapped = lo >= region_floor && hi <= mem_max_addr && lo < hi;
+    for (region_hole_t *hole = region_holes; mapped && hole;
+         hole = hole->next) {
+        if (lo < hole->hi && hole->lo < hi)
+            mapped = false;
+    }
+    pthread_mutex_unlock(&brk_lock);
+    return mapped;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -267,14 +572,51 @@ void *mem_heap_lo(void) {
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi(void) {
-    return (void *)(mem_brk - 1);
+    pthread_mutex_lock(&brk_lock);
+    unsigned char *brk = mem_brk;
+    pthread_mutex_unlock(&brk_lock);
+    return (void *)(brk - 1);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
 size_t mem_heapsize(void) {
-    return (size_t)(mem_brk - heap);
+    pthread_mutex_lock(&brk_lock);
+    size_t size = (size_t)(mem_brk - heap);
+    pthread_mutex_unlock(&brk_lock);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size since the last reset
+ */
+size_t mem_peak_heapsize(void) {
+    pthread_mutex_lock(&brk_lock);
+    size_t size = (size_t)(mem_peak - heap);
+    pthread_mutex_unlock(&brk_lock);
+    return size;
+}
+
+/*
+ * mem_mapped_size() - returns the bytes mapped in regions
+ */
+size_t mem_mapped_size(void) {
+    pthread_mutex_lock(&brk_lock);
+    size_t size = mem_mapped;
+    pthread_mutex_unlock(&brk_lock);
+    return size;
+}
+
+/*
+ * mem_peak_footprint() - returns the most bytes the heap and the mapped
+ * regions have held together since the last reset
+ */
+size_t mem_peak_footprint(void) {
+    pthread_mutex_lock(&brk_lock);
+    size_t size = mem_peak_total;
+    pthread_mutex_unlock(&brk_lock);
+    return size;
 }
 
 /*
@@ -286,6 +628,13 @@ size_t mem_pagesize(void) {
 
 /*************** Memory emulation  *******************/
 
+/* Is [addr, addr + len) in the heap or in the region space? */
+static bool emulated(const void *addr, size_t len) {
+    const unsigned char *lo = (const unsigned char *)addr;
+    return (lo >= heap && lo + len <= mem_brk) ||
+           (lo >= region_floor && lo + len <= mem_max_addr);
+}
+
 __int128_t mem_read128(const void *addr) {
     __int128_t r;
     r = (((__int128_t)mem_read((char *)addr + 8, 8)) << 64) | mem_read(addr, 8);
@@ -301,8 +650,7 @@ void mem_write128(void *addr, __int128_t val) {
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && emulated(addr, len)) {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
@@ -340,8 +688,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk) {
+    if (sparse && emulated(addr, len)) {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
@@ -396,6 +743,29 @@ void *mem_memcpy(void *dst, const void *src, size_t num_bytes) {
     return savedst;
 }
 
+/* Emulation of memmove */
+void *mem_memmove(void *dst, const void *src, size_t num_bytes) {
+    /* A forward copy is safe unless dst overlaps the end of src */
+    if ((uintptr_t)dst <= (uintptr_t)src) {
+        return mem_memcpy(dst, src, num_bytes);
+    }
+    size_t word_size = sizeof(uint64_t);
+    const unsigned char *s = (const unsigned char *)src + num_bytes;
+    unsigned char *d = (unsigned char *)dst + num_bytes;
+    while (num_bytes >= word_size) {
+        s -= word_size;
+        d -= word_size;
+        uint64_t data = mem_read(s, word_size);
+        mem_write(d, data, word_size);
+        num_bytes -= word_size;
+    }
+    if (num_bytes) {
+        uint64_t data = mem_read(src, num_bytes);
+        mem_write(dst, data, num_bytes);
+    }
+    return dst;
+}
+
 /* Emulation of memset */
 void *mem_memset(void *dst, int c, size_t num_bytes) {
     void *savedst = dst;
@@ -460,9 +830,84 @@ static void print_stats(void) {
         printf("Allocated %zu heap bytes.  Max address = %p\n", vbytes,
                (void *)mem_brk);
     }
+    if (mem_released > 0) {
+        printf("Shrank heap by %zu bytes in total, from a peak of %zu "
+               "bytes\n",
+               mem_released, mem_peak_heapsize());
+    }
+    if (mem_peak_total > mem_peak_heapsize()) {
+        printf("Heap and mapped regions held %zu bytes together at peak\n",
+               mem_peak_total);
+    }
     stats_printed = true;
 }
 
+/*
+ * Forget every region, leaving the region space empty.  If zero is set,
+ * the dense memory they used is made to read as zero again.
+ */
+static void clear_regions(bool zero) {
+    if (zero && region_floor < mem_max_addr) {
+#ifdef USE_ASAN
+        __asan_poison_memory_region(region_floor,
+                                    (size_t)(mem_max_addr - region_floor));
+#endif
+        zero_dense(region_floor, mem_max_addr);
+    }
+    while (region_holes) {
+        region_hole_t *hole = region_holes;
+        region_holes = hole->next;
+        free(hole);
+    }
+    region_floor = mem_max_addr;
+    mem_mapped = 0;
+}
+
+/*
+ * Make dense memory in [lo, hi) read as zero.  Whole pages are dropped, so
+ * that they stop being resident until touched again; the parts of pages
+ * at either end, or everything if the system refuses, are cleared instead.
+ */
+static void zero_dense(unsigned char *lo, unsigned char *hi) {
+    size_t page = mem_pagesize();
+    unsigned char *plo =
+        (unsigned char *)(((uintptr_t)lo + page - 1) & ~(uintptr_t)(page - 1));
+    unsigned char *phi =
+        (unsigned char *)((uintptr_t)hi & ~(uintptr_t)(page - 1));
+    if (plo >= phi || madvise(plo, (size_t)(phi - plo), MADV_DONTNEED) != 0) {
+        memset(lo, 0, (size_t)(hi - lo));
+        return;
+    }
+    memset(lo, 0, (size_t)(plo - lo));
+    memset(phi, 0, (size_t)(hi - phi));
+}
+
+/* Count the resident bytes of dense memory in [lo, hi), lo page-aligned */
+static size_t resident_bytes(unsigned char *lo, unsigned char *hi) {
+    size_t page = mem_pagesize();
+    unsigned char vec[1024];
+    size_t bytes = 0;
+    while (lo < hi) {
+        size_t len = (size_t)(hi - lo);
+        if (len > sizeof(vec) * page)
+            len = sizeof(vec) * page;
+        if (mincore(lo, len, vec) != 0)
+            return bytes + (size_t)(hi - lo); /* Assume the worst */
+        for (size_t i = 0; i < (len + page - 1) / page; i++)
+            if (vec[i] & 1)
+                bytes += page;
+        lo += len;
+    }
+    return bytes;
+}
+
+/* Raise the peak footprint to the current one, with brk_lock held */
+static void note_footprint(void) {
+    size_t total = (size_t)(mem_brk - heap) + mem_mapped;
+    if (total > mem_peak_total)
+        mem_peak_total = total;
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr) {
     ptrdiff_t offset =
@@ -477,6 +922,45 @@ static void *page_start(size_t id) {
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/*
+ * Give back the sparse pages that lie wholly in [lo, hi), and clear the
+ * part of the page holding lo that is past it, so that the heap reads as
+ * zero when it grows again.  A range spanning more pages than the page
+ * table has buckets (a giant region) is found by walking the whole table.
+ */
+static void release_pages(unsigned char *lo, unsigned char *hi) {
+    if (lo == hi)
+        return;
+    size_t first = page_id(lo);
+    size_t last = page_id(hi - 1);
+    size_t offset = (size_t)(lo - (unsigned char *)page_start(first));
+    bool by_id = last - first < num_buckets;
+    size_t count = by_id ? last - first + 1 : num_buckets;
+    for (size_t k = 0; k < count; k++) {
+        mem_block_t **link =
+            &page_table[by_id ? (first + k) % num_buckets : k];
+        while (*link) {
+            mem_block_t *block = *link;
+            if (block->id < first || block->id > last ||
+                (by_id && block->id != first + k)) {
+                link = &block->next;
+                continue;
+            }
+            if (block->id == first && offset > 0) {
+                memset(&block->bytes[offset], 0, SPARSE_PAGE_SIZE - offset);
+                for (size_t i = offset; i < SPARSE_PAGE_SIZE; i++)
+                    block->initSet[i / 8] &= (unsigned char)~(1u << (i % 8));
+                link = &block->next;
+                continue;
+            }
+            *link = block->next;
+            block->next = released_pages;
+            released_pages = block;
+            num_free_pages++;
+        }
+    }
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite) {
     size_t id = page_id(addr);
@@ -488,7 +972,11 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
         block = block->next;
     if (!block) {
         /* Need to allocate a new block */
-        if (num_free_pages == 0) {
+        if (released_pages) {
+            /* Reuse a page given back by shrinking the heap */
+            block = released_pages;
+            released_pages = block->next;
+        } else if (num_free_pages == 0) {
             /*
              * This will often fail due to student code that either accesses
              *  too many memory locations, such as checking every byte in a
@@ -498,12 +986,15 @@ static void *get_mem(const void *addr, size_t size, bool isWrite) {
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (!block) {
+            block = next_free_page++;
+        }
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
         for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
             block->initSet[i] = 0;
+        memset(block->bytes, 0, SPARSE_PAGE_SIZE);
         page_table[b] = block;
     }
 
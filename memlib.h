@@ -26,16 +26,99 @@ void mem_deinit(void);
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative `incr`
+ * shrinks the heap. Like memory from the operating system, the new heap
+ * area always reads as zero, even if it was part of the heap before.
+ * Threads may call it concurrently, except under sparse emulation.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre The heap must not shrink below its start
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Maps a region of memory apart from the heap.
+ *
+ * This function is a simple model of an anonymous mmap(). The region is
+ * page-aligned, reads as zero, and is taken from the top of the space the
+ * heap grows into, so mapped regions and the heap limit each other. Like
+ * the heap, regions are emulated under sparse emulation.
+ *
+ * @param[in] size The minimum size of the region, in bytes
+ * @return The start address of the region, or NULL if there is no room
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Unmaps a region returned by `mem_map`.
+ * @param[in] addr The start address of the region
+ * @param[in] size The size the region was mapped with
+ */
+void mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Maps scratch space for the allocator's own checks.
+ *
+ * The region is mapped like one from `mem_map`, but is left out of
+ * `mem_mapped_size` and `mem_peak_footprint`, so checking a heap does not
+ * change what it is measured to use.
+ *
+ * @param[in] size The minimum size of the region, in bytes
+ * @return The start address of the region, or NULL if there is no room
+ */
+void *mem_map_scratch(size_t size);
+
+/**
+ * @brief Unmaps a region returned by `mem_map_scratch`.
+ * @param[in] addr The start address of the region
+ * @param[in] size The size the region was mapped with
+ */
+void mem_unmap_scratch(void *addr, size_t size);
+
+/**
+ * @brief Discards the pages of a range of the heap or of a region.
+ *
+ * This function is a simple model of madvise(MADV_DONTNEED). The whole
+ * pages in the range stop being resident and read as zero from then on,
+ * but remain part of the heap or region; parts of pages at either end of
+ * the range are left alone.
+ *
+ * @param[in] addr The first address of the range
+ * @param[in] size The length of the range, in bytes
+ */
+void mem_discard(void *addr, size_t size);
+
+/**
+ * @brief Tells whether a range of addresses lies in mapped regions.
+ * @param[in] addr The first address of the range
+ * @param[in] len The length of the range, in bytes
+ * @return True if the whole range is mapped
+ */
+bool mem_is_mapped(const void *addr, size_t len);
+
+/**
+ * @brief Returns the number of bytes mapped in regions.
+ * @return The total size of the mapped regions, in bytes
+ */
+size_t mem_mapped_size(void);
+
+/**
+ * @brief Returns the most memory the heap and the mapped regions have held
+ *        together since the heap was last reset.
+ * @return The peak combined size, in bytes
+ */
+size_t mem_peak_footprint(void);
+
+/**
+ * @brief Returns the number of bytes of the heap and the mapped regions
+ *        that are backed by memory, which discarded and untouched pages
+ *        are not.
+ * @return The resident size, in bytes
+ */
+size_t mem_resident(void);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
@@ -63,6 +146,12 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest size the heap has had since it was last reset.
+ * @return The peak size of the heap, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -112,6 +201,15 @@ void mem_write128(void *addr, __int128_t val);
  */
 void *mem_memcpy(void *dst, const void *src, size_t n);
 
+/**
+ * @brief Emulation of memmove
+ * @param[in] dst
+ * @param[in] src
+ * @param[in] n
+ * @return
+ */
+void *mem_memmove(void *dst, const void *src, size_t n);
+
 /**
  * @brief Emulation of memset
  * @param[in] dst
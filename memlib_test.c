@@ -0,0 +1,198 @@
+/*
+ * memlib_test.c - Tests of the simulated memory system, run by `make test`.
+ *
+ * Each test starts from an empty heap and no mapped regions, and checks
+ * what the allocator may rely on when it grows and shrinks the heap or
+ * maps and unmaps regions.  Failures are reported on stderr and in the exit
+ * status.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memlib.h"
+
+static int failures = 0;
+
+/*
+ * check - Report a failed condition of a test
+ */
+static void check(bool ok, const char *test, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: %s\n", test, what);
+        failures++;
+    }
+}
+
+/*
+ * all_zero - Whether the n bytes at p are all zero
+ */
+static bool all_zero(const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * test_regrow_reads_zero - Shrink a dense heap whose top was written, then
+ * grow it again past its old break. The pages above the shrunk break are
+ * kept, not released, so growing into them must clear what was written.
+ */
+static void test_regrow_reads_zero(void) {
+    const char *test = "regrow_reads_zero";
+    enum { BASE = 4096, TOP = 3 * 4096, MORE = 4096 };
+    mem_reset_brk();
+
+    unsigned char *base = mem_sbrk(BASE);
+    check(base != (void *)-1, test, "first growth failed");
+    unsigned char *top = mem_sbrk(TOP);
+    check(top != (void *)-1, test, "second growth failed");
+    memset(top, 0xa5, TOP);
+
+    check(mem_sbrk(-(intptr_t)TOP) == top + TOP, test, "shrink failed");
+    check(mem_heapsize() == BASE, test, "shrink left the wrong size");
+
+    unsigned char *again = mem_sbrk(TOP + MORE);
+    check(again == top, test, "growth after shrink moved");
+    check(all_zero(again, TOP + MORE), test, "grown memory not zero");
+}
+
+/*
+ * test_hole_reused - A region unmapped between two others leaves a hole,
+ * which the next mapping that fits takes instead of going below them.
+ */
+static void test_hole_reused(void) {
+    const char *test = "hole_reused";
+    size_t page = mem_pagesize();
+    mem_reset_brk();
+
+    unsigned char *a = mem_map(2 * page);
+    unsigned char *b = mem_map(2 * page);
+    unsigned char *c = mem_map(2 * page);
+    check(a != NULL && b != NULL && c != NULL, test, "mapping failed");
+    check(b + 2 * page == a && c + 2 * page == b, test,
+          "regions not carved downward");
+
+    mem_unmap(b, 2 * page);
+    check(mem_mapped_size() == 4 * page, test, "unmap not counted");
+    check(mem_map(page) == b + page, test, "hole not reused");
+    check(mem_map(page) == b, test, "rest of the hole not reused");
+    check(mem_map(page) == c - page, test, "full hole reused");
+}
+
+/*
+ * test_holes_merge - Holes next to each other merge, whichever is made
+ * first, so a mapping as large as both fits where they were.
+ */
+static void test_holes_merge(void) {
+    const char *test = "holes_merge";
+    size_t page = mem_pagesize();
+    mem_reset_brk();
+
+    unsigned char *r[6];
+    for (int i = 0; i < 6; i++) {
+        r[i] = mem_map(page);
+    }
+    check(r[5] != NULL && r[5] + 5 * page == r[0], test, "mapping failed");
+
+    /* The lower hole comes second and merges with the one above it */
+    mem_unmap(r[1], page);
+    mem_unmap(r[2], page);
+    check(mem_map(2 * page) == r[2], test, "hole below not merged");
+
+    /* The upper hole comes second and merges with the one below it */
+    mem_unmap(r[4], page);
+    mem_unmap(r[3], page);
+    check(mem_map(2 * page) == r[4], test, "hole above not merged");
+
+    /* A hole between two others joins both */
+    mem_reset_brk();
+    for (int i = 0; i < 4; i++) {
+        r[i] = mem_map(page);
+    }
+    mem_unmap(r[0], page);
+    mem_unmap(r[2], page);
+    mem_unmap(r[1], page);
+    check(mem_map(3 * page) == r[2], test, "three holes not merged");
+}
+
+/*
+ * test_floor_lifts - Unmapping the lowest region gives its pages back to
+ * the space below the regions, along with any hole just above it.
+ */
+static void test_floor_lifts(void) {
+    const char *test = "floor_lifts";
+    size_t page = mem_pagesize();
+    mem_reset_brk();
+
+    unsigned char *a = mem_map(page);
+    unsigned char *b = mem_map(page);
+    unsigned char *c = mem_map(page);
+    check(a != NULL && b != NULL && c != NULL, test, "mapping failed");
+
+    mem_unmap(c, page);
+    unsigned char *d = mem_map(2 * page);
+    check(d == b - 2 * page, test, "floor not lifted");
+
+    /* The hole b leaves merges into the space freed below it */
+    mem_unmap(b, page);
+    mem_unmap(d, 2 * page);
+    unsigned char *e = mem_map(4 * page);
+    check(e == a - 4 * page, test, "floor not lifted past the hole above");
+
+    mem_unmap(e, 4 * page);
+    mem_unmap(a, page);
+    check(mem_mapped_size() == 0, test, "regions still counted");
+    check(mem_map(page) == a, test, "space not back to empty");
+}
+
+/*
+ * test_remap_reads_zero - Pages written in a region read as zero once
+ * the region is unmapped and the same space is mapped again.
+ */
+static void test_remap_reads_zero(void) {
+    const char *test = "remap_reads_zero";
+    size_t page = mem_pagesize();
+    mem_reset_brk();
+
+    unsigned char *a = mem_map(page);
+    unsigned char *b = mem_map(3 * page);
+    unsigned char *c = mem_map(page);
+    check(a != NULL && b != NULL && c != NULL, test, "mapping failed");
+    memset(b, 0xa5, 3 * page);
+
+    /* From a hole */
+    mem_unmap(b, 3 * page);
+    unsigned char *again = mem_map(3 * page);
+    check(again == b, test, "hole not reused");
+    check(all_zero(again, 3 * page), test, "remapped hole not zero");
+
+    /* From below a lifted floor */
+    memset(c, 0x5a, page);
+    mem_unmap(c, page);
+    again = mem_map(page);
+    check(again == c, test, "floor not reused");
+    check(all_zero(again, page), test, "remapped floor not zero");
+}
+
+int main(void) {
+    mem_init(false);
+
+    test_regrow_reads_zero();
+    test_hole_reused();
+    test_holes_merge();
+    test_floor_lifts();
+    test_remap_reads_zero();
+
+    mem_deinit();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("memlib_test: all tests passed\n");
+    return 0;
+}
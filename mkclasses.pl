@@ -0,0 +1,136 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# This program generates the size-class table of the allocator's seglists
+# (see MM_CLASSES in mm-policy.h). Class i holds the free blocks from its
+# lower bound up to the next class's; blocks past the last class live in
+# the tree. The classes either follow a two-level (TLSF-style) spacing, a
+# number of linear sub-classes per power of two, or are listed explicitly.
+# The header may also set the chunk size, making it a whole configuration
+# such as the one tune.pl writes.
+#
+##############################################################################
+
+sub usage
+{
+    print STDERR "$_[0]\n";
+    print STDERR "Usage: $0 [-h] [-s SPACING] [-n COUNT] [-b BOUNDS] [-c CHUNK]\n";
+    print STDERR "Options:\n";
+    print STDERR "  -h         Print this message\n";
+    print STDERR "  -s SPACING log2 of the classes per power of two (default 2)\n";
+    print STDERR "  -n COUNT   Number of classes (default 32)\n";
+    print STDERR "  -b BOUNDS  Comma-separated class lower bounds in bytes,\n";
+    print STDERR "             then the tree's (overrides -s and -n)\n";
+    print STDERR "  -c CHUNK   Least bytes the heap grows by (default: mm-policy.h)\n";
+    exit(1);
+}
+
+# Block sizes are multiples of this; the lookup table has one entry per
+# such granule below the tree
+$dsize = 16;
+
+# Bits of the class bitmap, and so the most classes there can be
+$max_classes = 64;
+
+# Smallest tree block: it must hold a header, the tree links and a footer
+$min_tree = 64;
+
+# Largest tree block, which bounds the lookup table to 4096 entries
+$max_tree = 1 << 16;
+
+getopts('hs:n:b:c:');
+
+if ($opt_h) {
+    usage("");
+}
+
+$spacing = defined($opt_s) ? $opt_s : 2;
+$count = defined($opt_n) ? $opt_n : 32;
+
+@bounds = ();
+if ($opt_b) {
+    @bounds = split(/,/, $opt_b);
+    $tree = pop(@bounds);
+} else {
+    ($spacing =~ /^\d+$/ && $spacing <= 5) ||
+        usage("Class spacing must be between 0 and 5");
+    ($count =~ /^\d+$/ && $count >= 1) ||
+        usage("Class count must be a positive integer");
+    # Linear steps of dsize below the first split power of two, then
+    # 2^spacing equal steps per power of two
+    $step = $dsize;
+    $size = 0;
+    $limit = $dsize << $spacing;
+    while (@bounds < $count) {
+        push(@bounds, $size);
+        $size += $step;
+        $size <= $max_tree ||
+            usage("The tree must start between $min_tree and $max_tree bytes");
+        if ($size >= $limit) {
+            $step = $limit >> $spacing;
+            $limit *= 2;
+        }
+    }
+    $tree = $size;
+}
+
+(@bounds >= 1 && @bounds <= $max_classes) ||
+    usage("Need between 1 and $max_classes classes");
+$bounds[0] == 0 || usage("The first class must start at 0");
+$prev = -1;
+foreach $b (@bounds, $tree) {
+    ($b =~ /^\d+$/ && $b % $dsize == 0) ||
+        usage("Class bound '$b' is not a multiple of $dsize");
+    $b > $prev || usage("Class bounds must increase");
+    $prev = $b;
+}
+($tree >= $min_tree && $tree <= $max_tree) ||
+    usage("The tree must start between $min_tree and $max_tree bytes");
+!defined($opt_c) || ($opt_c =~ /^\d+$/ && $opt_c >= $min_tree &&
+                     $opt_c % $dsize == 0) ||
+    usage("Chunk size must be a multiple of $dsize of at least $min_tree");
+
+$len = @bounds;
+$args = join(" ", map { "-$_ " . ${"opt_$_"} } grep { defined(${"opt_$_"}) }
+             ("s", "n", "b", "c"));
+$args = $args eq "" ? "" : " $args";
+
+print "/**\n";
+print " * \@file\n";
+print " * \@brief Size classes of the seglists\n";
+print " *\n";
+print " * Generated by mkclasses.pl$args; do not edit.\n";
+print " */\n\n";
+
+if (defined($opt_c)) {
+    print "/** \@brief Least number of bytes the heap grows by */\n";
+    print "#define MM_CHUNK_SIZE $opt_c\n\n";
+}
+
+print "/** \@brief Number of seglists */\n";
+print "enum { LEN = $len };\n\n";
+
+print "/** \@brief Free blocks of at least this size are kept in the tree */\n";
+print "static const size_t tree_min_size = $tree;\n\n";
+
+print "/** \@brief Smallest block size held by each seglist */\n";
+print "static const uint32_t seglist_bound[LEN] = {";
+for ($i = 0; $i < $len; $i++) {
+    print $i % 8 == 0 ? "\n    " : " ";
+    print "$bounds[$i],";
+}
+print "\n};\n\n";
+
+print "/** \@brief Seglist of each block size below the tree, by size / $dsize */\n";
+printf "static const uint8_t seglist_of_size[%d] = {", $tree / $dsize;
+$idx = 0;
+for ($g = 0; $g < $tree / $dsize; $g++) {
+    while ($idx + 1 < $len && $bounds[$idx + 1] <= $g * $dsize) {
+        $idx++;
+    }
+    print $g % 16 == 0 ? "\n    " : " ";
+    print "$idx,";
+}
+print "\n};\n";
@@ -0,0 +1,52 @@
+/**
+ * @file mm-policy.h
+ * @brief Compile-time policy knobs of the allocator
+ *
+ * Each knob is an object-like macro that a build may set with -D; the
+ * variants in the Makefile are built this way from the same mm.c. The
+ * allocator turns the knobs into constants, so a variant carries no code
+ * for the policies it does not use.
+ */
+#ifndef MM_POLICY_H__
+#define MM_POLICY_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Header holding the size classes, generated by mkclasses.pl. It
+ *        is read before the other knobs, which it may set as well.
+ */
+#ifndef MM_CLASSES
+#define MM_CLASSES "mm-classes.h"
+#endif
+#include MM_CLASSES
+
+/** @brief Fit searches take the first block on a seglist that fits */
+#define MM_FIT_FIRST 0
+/** @brief Fit searches take the block on a seglist that fits best */
+#define MM_FIT_BEST 1
+/** @brief Fit searches take the best of the first few blocks on a seglist
+ *         (see `MM_FIT_CANDIDATES`) */
+#define MM_FIT_BOUNDED 2
+
+/** @brief How a fit search picks among the blocks of a seglist */
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY MM_FIT_BOUNDED
+#endif
+
+/**
+ * @brief 1 to keep freed blocks of the quick list sizes whole, coalescing
+ *        them later (see `MM_QUICK_LIMIT`), 0 to coalesce every freed
+ *        block at once
+ */
+#ifndef MM_DEFER_COALESCING
+#define MM_DEFER_COALESCING 1
+#endif
+
+/** @brief Least number of bytes the heap grows by (a multiple of 16) */
+#ifndef MM_CHUNK_SIZE
+#define MM_CHUNK_SIZE 4096
+#endif
+
+#endif /* MM_POLICY_H__ */
@@ -9,7 +9,10 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -18,6 +21,7 @@
 #include <unistd.h>
 
 #include "memlib.h"
+#include "mm-policy.h"
 #include "mm.h"
 
 /* Do not change the following! */
@@ -34,6 +38,11 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+/* The driver checks memmove like memset and memcpy */
+#define memmove mem_memmove
+#endif /* def DRIVER */
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -51,6 +60,9 @@
 #define dbg_ensures(expr) assert(expr)
 #define dbg_printf(...) ((void)printf(__VA_ARGS__))
 #define dbg_printheap(...) print_heap(__VA_ARGS__)
+/* Blocks whose headers are written are logged for mm_checkheap */
+#define dbg_touch(block) touch_block(block)
+static const bool track_dirty = true;
 #else
 /* When DEBUG is not defined, these should emit no code whatsoever,
  * not even from evaluation of argument expressions.  However,
@@ -80,6 +92,8 @@
 #define dbg_ensures(expr) dbg_discard_expr_(expr)
 #define dbg_printf(...) dbg_discard_expr_((__VA_ARGS__))
 #define dbg_printheap(...) dbg_discard_expr_((__VA_ARGS__))
+#define dbg_touch(block) dbg_discard_expr_(block)
+static const bool track_dirty = false;
 #endif
 
 /* Basic constants */
@@ -101,7 +115,13 @@ static const size_t min_block_size = dsize;
  * to extend the heap.
  * (Must be divisible by dsize)
  */
-static const size_t chunksize = (1 << 12);
+static const size_t chunksize = MM_CHUNK_SIZE;
+
+/** @brief How fit searches pick among the blocks of a seglist */
+static const int fit_policy = MM_FIT_POLICY;
+
+/** @brief Whether freed blocks may wait on the quick lists uncoalesced */
+static const bool defer_coalescing = MM_DEFER_COALESCING;
 
 /**
  * Status bit in block header.
@@ -121,6 +141,28 @@ static const word_t prev_alloc_mask = 0x2;
  */
 static const word_t prev_mini_mask = 0x4;
 
+/**
+ * Flag bit set only in the header of a free mini block. Such a header
+ * stores the block's fprev link in place of its size, which is implied to
+ * be `min_block_size`. Block headers sit 8 bytes below a 16-byte aligned
+ * payload, so this bit is always set in a link and the flags below it
+ * stay free.
+ */
+static const word_t mini_free_mask = 0x8;
+
+/**
+ * Bits that are both set only in the header of a block living in a region
+ * of its own, outside the heap. Allocated heap blocks never carry
+ * `mini_free_mask`, so the pair cannot be mistaken for anything else.
+ */
+static const word_t mapped_mask = 0x9;
+
+/**
+ * Flag bit in the footer of a free block that is soft-reserved as room for
+ * the allocated block in front of it to grow into.
+ */
+static const word_t reserved_mask = 0x2;
+
 /**
  * Bits in block header masking the size of current block.
  */
@@ -132,9 +174,20 @@ typedef struct fblocks {
     struct block *fprev;
 } fblocks_t;
 
+/** @brief Represents the links of a free block in the size-ordered tree */
+typedef struct tnode {
+    struct block *left;
+    struct block *right;
+    struct block *parent;
+    /** @brief Value of the free clock when the block entered the tree, or
+     *         0 once its pages have been released */
+    word_t freed;
+} tnode_t;
+
 /** @brief Union represents the payload or free block pointers */
 union Data {
     fblocks_t fblocks;
+    tnode_t tnode;
     char payload[0];
 };
 
@@ -150,19 +203,320 @@ typedef struct block {
 
 } block_t;
 
+/**
+ * Small requests are served from slab runs: `slab_run_size`-aligned blocks
+ * carved into equal objects of one size class, with no per-object header.
+ * Class `c` holds payloads of up to `(c + 1) * dsize` bytes.
+ */
+enum {
+    SLAB_CLASSES = 8,    /* number of slab size classes */
+    SLAB_USED_WORDS = 2, /* occupancy bitmap words per run */
+    SLAB_MAP_WORDS = 32  /* words in the run map (bits = runs covered) */
+};
+
+/**
+ * Threads are spread over `ARENA_COUNT` arenas, each owning its own slab
+ * runs. A thread also keeps up to `TCACHE_COUNT` freed objects per slab
+ * class in a private cache, handed out again without taking any lock.
+ */
+enum {
+    ARENA_COUNT = 4,  /* number of arenas */
+    TCACHE_COUNT = 16 /* objects cached per thread and slab class */
+};
+
+/** @brief Number of recently grown blocks remembered by realloc */
+enum { GROWN_SLOTS = 16 };
+
+/** @brief Size of a cache line, the unit the control block is laid out in */
+enum { CACHE_LINE = 64 };
+
+/**
+ * Debug builds log the blocks whose headers were written since the last
+ * heap check, up to `DIRTY_SLOTS` of them, so that the check can look at
+ * just those (see `mm_checkheap`).
+ */
+enum { DIRTY_SLOTS = 32 };
+
+/**
+ * Freed blocks just too large for a slab run are kept whole on a quick
+ * list for their exact size, still marked allocated, so that a request of
+ * the same size can take one back without splitting or coalescing. List
+ * `i` holds blocks of `quick_min_size + i * dsize` bytes.
+ */
+enum { QUICK_LISTS = 12 };
+
+/** @brief Largest request served from a slab run */
+static const size_t slab_max_size = SLAB_CLASSES * 16;
+
+/** @brief Size of the blocks on the first quick list */
+static const size_t quick_min_size = SLAB_CLASSES * 16 + 16;
+
+/**
+ * @brief Size and alignment of a slab run (must be a power of two, and
+ * small enough that `SLAB_USED_WORDS` bitmap words cover its objects)
+ */
+static const size_t slab_run_size = (1 << 11);
+
+/** @brief log2 of `dsize`, the granularity of block sizes */
+static const int dsize_log2 = 4;
+
+/**
+ * @brief Ticks of the free clock a block must spend in the tree before
+ * its pages are released, and between two sweeps for such blocks
+ */
+static const word_t release_age = 1024;
+
+/** @brief Heap checks between two full sweeps of the heap in debug builds */
+static const word_t full_check_period = 1024;
+
+/**
+ * @brief Header at the start of a slab run.
+ *
+ * A run is the payload of an ordinary allocated block, aligned so that the
+ * header sits at a `slab_run_size` boundary. Objects follow the header;
+ * bit `i` of `used` is set while object `i` is allocated.
+ */
+typedef struct slab_run {
+    /** @brief Next run of the same class with free objects */
+    struct slab_run *next;
+    /** @brief Previous run of the same class with free objects */
+    struct slab_run *prev;
+    /** @brief Object size in bytes */
+    uint32_t osize;
+    /** @brief Number of objects in the run */
+    uint32_t nobjs;
+    /** @brief Number of free objects in the run */
+    uint32_t nfree;
+    /** @brief Size class of the run */
+    uint16_t cls;
+    /** @brief Arena owning the run */
+    uint16_t arena;
+    /** @brief Occupancy bitmap */
+    word_t used[SLAB_USED_WORDS];
+} slab_run_t;
+
+/** @brief A spin lock, held while nonzero */
+typedef _Atomic uint32_t lock_t;
+
+/**
+ * @brief Slab state owned by one arena.
+ *
+ * Runs of an arena are only touched with its lock held. An object freed
+ * by a thread of another arena is pushed onto the arena's remote list
+ * without taking the lock, and the arena's own threads return it to its
+ * run the next time they take the lock to allocate.
+ */
+typedef struct arena {
+    /** @brief Lock guarding the runs of this arena */
+    lock_t lock;
+    /** @brief Index of the arena in the control block */
+    uint32_t id;
+    /** @brief Runs with at least one free object, per slab class */
+    struct slab_run *slab_partial[SLAB_CLASSES];
+    /** @brief Objects freed by other arenas' threads, linked through
+     *         their first word */
+    void *_Atomic remote_free;
+    /** @brief Set when no new run fits in the pages the run map covers,
+     *         until a run is handed back */
+    _Atomic bool runs_exhausted;
+} arena_t;
+
+/**
+ * @brief A thread's cache of freed slab objects.
+ *
+ * Cached objects stay marked in use in their runs; each holds the link to
+ * the next object of its class in its first word.
+ */
+typedef struct tcache {
+    /** @brief Most recently cached object, per slab class */
+    void *head[SLAB_CLASSES];
+    /** @brief Number of cached objects, per slab class */
+    uint8_t count[SLAB_CLASSES];
+} tcache_t;
+
+/**
+ * @brief An explicit free list.
+ *
+ * The head, count and bytes of a size class are used together, so they are
+ * kept side by side rather than in arrays of their own.
+ */
+typedef struct seglist {
+    /** @brief Most recently inserted block, or NULL if the list is empty */
+    block_t *head;
+    /** @brief Bytes of the free blocks on the list */
+    word_t bytes;
+    /** @brief Number of free blocks on the list */
+    uint32_t count;
+} seglist_t;
+
+/**
+ * @brief Allocator control block.
+ *
+ * Lives at the very bottom of the heap, just below the prologue, so that
+ * the seglist heads do not count against the driver's global data limit.
+ * The heap is page aligned, so the control block starts a cache line, and
+ * its fields are ordered by how often the hot paths touch them.
+ * A bit is set in `class_bitmap` for each non-empty seglist. Free blocks
+ * too large for any seglist hang off `tree_root`.
+ *
+ * Blocks are shared by all threads and guarded by `heap_lock`; slab runs
+ * belong to one of the `arenas`, each guarded by its own lock. A thread
+ * holding an arena lock may take the heap lock, never the other way round.
+ */
+typedef struct ctl {
+    /*
+     * The first line holds what nearly every heap operation reads, and the
+     * lock taken first so that it comes in along with them.
+     */
+    /** @brief Lock guarding the blocks and the heap state below */
+    _Alignas(CACHE_LINE) lock_t heap_lock;
+    /** @brief Number of soft-reserved free blocks */
+    uint32_t reserve_count;
+    /** @brief Bit `i` set while seglist `i` is non-empty */
+    word_t class_bitmap;
+    /** @brief Root of the size-ordered tree of large free blocks */
+    block_t *tree_root;
+    /**
+     * @brief Start of the clean part of the heap. No block past this has
+     * been handed out since the heap grew, so apart from the metadata of
+     * the free blocks there (header, list or tree links, footer) it still
+     * reads as zero.
+     */
+    char *clean_lo;
+
+    /* The second line holds the counters allocations and frees bump */
+    /** @brief Blocks freed under the heap lock since `mm_init`, plus one;
+     *         the clock by which free blocks age */
+    _Alignas(CACHE_LINE) word_t free_clock;
+    /** @brief Bytes held in blocks on the quick lists */
+    word_t quick_bytes;
+    /** @brief Free blocks examined by fit searches */
+    word_t fit_probes;
+    /** @brief Blocks split to place a request (see `mm_stats`) */
+    word_t splits;
+    /** @brief Free neighbors merged into freed blocks */
+    word_t coalesces;
+    /** @brief Number of free blocks in the tree */
+    word_t tree_count;
+    /** @brief Bytes of the free blocks in the tree */
+    word_t tree_bytes;
+    /** @brief Allocations served from a quick list */
+    word_t quick_hits;
+
+    /** @brief The explicit free lists, one per size class */
+    seglist_t seglist[LEN];
+    /** @brief Most recently freed block on each quick list, linked through
+     *         the first word of the payload */
+    block_t *quick[QUICK_LISTS];
+
+    /* Cold heap state */
+    /** @brief Soft-reserved free blocks, a circular list like a seglist */
+    block_t *reserve_list;
+    /** @brief Next slot of `grown` to overwrite */
+    uint32_t grown_next;
+    /** @brief Payloads of blocks recently grown by realloc */
+    void *grown[GROWN_SLOTS];
+    /** @brief Bytes held in soft-reserved free blocks */
+    word_t reserve_bytes;
+    /** @brief Reallocs finished in place by growing into a reservation */
+    word_t copies_avoided;
+    /** @brief Bytes calloc did not need to clear */
+    word_t calloc_clean_bytes;
+    /** @brief Calls to `extend_heap` */
+    word_t extends;
+
+    /** @brief Arenas owning the slab runs */
+    arena_t arenas[ARENA_COUNT];
+    /** @brief Number of threads handed an arena since `mm_init` */
+    _Atomic word_t threads;
+    /**
+     * @brief One bit per `slab_run_size` page of the heap, set when the
+     * page holds a slab run. Runs are only placed in covered pages. Read
+     * without a lock, so only changed atomically, and kept off the lines
+     * written under the locks.
+     */
+    _Alignas(CACHE_LINE) _Atomic word_t slab_map[SLAB_MAP_WORDS];
+
+    /** @brief Blocks whose headers were written since the last heap check */
+    block_t *dirty[DIRTY_SLOTS];
+    /** @brief Number of blocks in `dirty`, or more than `DIRTY_SLOTS` if
+     *         some were not logged and the next check must be a full one */
+    word_t dirty_count;
+    /** @brief Heap checks since the last full one */
+    word_t checks;
+} ctl_t;
+
+_Static_assert(LEN <= 8 * sizeof(word_t) && (int)LEN <= (int)MM_STATS_BUCKETS,
+               "the class bitmap and mm_stats must cover every seglist");
+
+_Static_assert(sizeof(ctl_t) % (2 * sizeof(word_t)) == 0,
+               "control block must preserve payload alignment");
+
+_Static_assert(offsetof(ctl_t, free_clock) == CACHE_LINE &&
+                   offsetof(ctl_t, seglist) == 2 * CACHE_LINE,
+               "hot control block fields must fill the first two lines");
+
 /* Global variables */
 
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
 
-/** @brief const number of total seglists */
-enum { LEN = 10 };
+/** @brief Pointer to the allocator control block */
+static ctl_t *ctl = NULL;
+
+/** @brief Number of times the heap has been initialized */
+static uint32_t heap_epoch = 0;
+
+/** @brief Per-thread allocator state, stale unless `epoch == heap_epoch` */
+typedef struct thread_state {
+    /** @brief The thread's object cache, or NULL if it has none yet */
+    tcache_t *cache;
+    /** @brief Value of `heap_epoch` when the state was set up */
+    uint32_t epoch;
+    /** @brief Index of the thread's arena */
+    uint32_t arena;
+} thread_state_t;
+
+/** @brief Allocator state of the calling thread */
+static _Thread_local thread_state_t thread_state;
+
+/**
+ * @brief Maximum number of free blocks examined by a fit search on one
+ * seglist (see `MM_FIT_CANDIDATES`)
+ */
+static uint32_t fit_candidates = 4;
+
+/**
+ * @brief Slack reserved behind a block grown more than once by realloc, in
+ * percent of its new size (see `MM_REALLOC_RESERVE`)
+ */
+static uint32_t reserve_percent = 50;
+
+/**
+ * @brief Size a free block at the top of the heap must reach for free to
+ * shrink the heap, or 0 to never do so (see `MM_TRIM_THRESHOLD`)
+ */
+static size_t trim_threshold = (1 << 20);
+
+/**
+ * @brief Bytes the quick lists may hold before they are consolidated, or 0
+ * to free every block at once (see `MM_QUICK_LIMIT`)
+ */
+static size_t quick_limit = (1 << 16);
 
-/** @brief Pointer to last free block on the explicit free list */
-static block_t *seglist[LEN];
+/**
+ * @brief Requests of at least this many bytes are given regions of their
+ * own, or none are if 0 (see `MM_MAP_THRESHOLD`). Kept well above the
+ * sizes programs recycle through the heap, such as growing hash tables.
+ */
+static size_t map_threshold = (1 << 20);
 
-/** @brief int to count the number of free blocks */
-static int fcounts[LEN];
+/**
+ * @brief Free blocks of at least this size have their interior pages
+ * released once they have aged, or none do if 0 (see
+ * `MM_RELEASE_THRESHOLD`)
+ */
+static size_t release_threshold = (1 << 16);
 
 /*
  *****************************************************************************
@@ -194,6 +548,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the minimum of two integers.
+ * @param[in] x
+ * @param[in] y
+ * @return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -233,12 +597,16 @@ static word_t pack(size_t size, bool alloc, bool prev_alloc, bool prev_mini) {
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. Free mini block headers carry a link instead of a
+ * size, so their size is reported as `min_block_size`.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
+    if ((word & mapped_mask) == mini_free_mask) {
+        return min_block_size;
+    }
     return (word & size_mask);
 }
 
@@ -314,6 +682,15 @@ static bool get_mini_prev(block_t *block) {
     return extract_mini_prev(block->header);
 }
 
+/**
+ * @brief Check whether a block lives in a region of its own.
+ * @param[in] block pointer to the block
+ * @return True if it's a mapped block
+ */
+static bool get_mapped(block_t *block) {
+    return (block->header & mapped_mask) == mapped_mask;
+}
+
 /**
  * @brief Given a payload pointer, returns a pointer to the corresponding
  *        block.
@@ -407,23 +784,74 @@ static void write_epilogue(block_t *block) {
     block->header = pack(0, true, false, false);
 }
 
+/**
+ * @brief Logs a block whose header was just written for the next heap
+ *        check.
+ *
+ * A block that grew over others takes their place in the log: logged
+ * addresses now inside it no longer start blocks and are dropped.
+ *
+ * @param[in] block a block in the heap
+ */
+static void touch_block(block_t *block) {
+    if (ctl->dirty_count > DIRTY_SLOTS) {
+        return;
+    }
+    char *end = (char *)block + get_size(block);
+    word_t n = 0;
+    for (word_t i = 0; i < ctl->dirty_count; i++) {
+        char *logged = (char *)ctl->dirty[i];
+        if (logged < (char *)block || logged >= end) {
+            ctl->dirty[n++] = ctl->dirty[i];
+        }
+    }
+    if (n == DIRTY_SLOTS) {
+        ctl->dirty_count = DIRTY_SLOTS + 1;
+        return;
+    }
+    ctl->dirty[n++] = block;
+    ctl->dirty_count = n;
+}
+
 /**
  * @brief Find which seglist a given block belogns to based on size.
  *
+ * The seglists partition the sizes below `tree_min_size` into the classes
+ * of the generated table (see `MM_CLASSES`), so this is a single lookup.
+ *
  * @param[in] size block size used to search
+ * @return index of the seglist
  */
 static int find_seglist(size_t size) {
-    size_t curr_size = min_block_size;
-    int idx = 0;
-    while (curr_size < size) {
-        curr_size *= 2;
-        if (idx >= LEN - 1) {
-            break;
-        }
-        idx++;
-    }
+    dbg_requires(size < tree_min_size && "size belongs in the tree");
+    return seglist_of_size[size >> dsize_log2];
+}
+
+/**
+ * @brief Returns the smallest block size held by a seglist.
+ *
+ * @param[in] idx index of the seglist
+ * @return lower bound of the seglist's size range
+ */
+static size_t seglist_min_size(int idx) {
+    return seglist_bound[idx];
+}
 
-    return idx;
+/**
+ * @brief Finds the first non-empty seglist strictly above a given one.
+ *
+ * Every block on the returned seglist is larger than any block that
+ * belongs on seglist `idx`.
+ *
+ * @param[in] idx index of the seglist to search above
+ * @return index of the seglist, or -1 if all larger seglists are empty
+ */
+static int find_seglist_above(int idx) {
+    word_t map = ctl->class_bitmap & (~(word_t)1 << idx);
+    if (map == 0) {
+        return -1;
+    }
+    return __builtin_ctzll(map);
 }
 
 /**
@@ -449,193 +877,494 @@ static block_t *find_next_fblock(block_t *block) {
     return block->data.fblocks.fnext;
 }
 
-static block_t *find_prev_fmini(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires(get_size(block) == min_block_size);
-    if (block == NULL || get_alloc(block) || get_size(block) > min_block_size) {
-        return NULL;
-    }
-    if (fcounts[0] == 2) {
-        return find_next_fblock(seglist[0]);
-    }
-    block_t *prev_block = NULL;
-    block_t *itr = seglist[0];
-    int i = 1;
-    if (itr == block) {
-        while (i < fcounts[0]) {
-            itr = find_next_fblock(itr);
-            i++;
-        }
-        return itr;
-    } else {
-        while (i <= fcounts[0]) {
-            if (itr == block) {
-                return prev_block;
-            }
-            prev_block = itr;
-            itr = find_next_fblock(itr);
-            i++;
-        }
-    }
-
-    return NULL;
-}
-
 /**
  * @brief Finds the previous consecutive block on the explicit free list.
  *
- * This function accesses the previous free block on the heap by following
- * the fprev pointer stored on current block.
+ * Regular free blocks keep the back link in their fprev field. A free mini
+ * block has no room for it, so the link lives in the upper bits of its
+ * header instead (see `mini_free_mask`).
  *
  * @param[in] block A block in the heap
  * @return The previous consecutive free block on the heap
  * @pre The block is not the epilogue
- * @pre The block is a free block
+ * @pre The block is a free block on a free list
  */
 static block_t *find_prev_fblock(block_t *block) {
     dbg_requires(block != NULL);
     dbg_requires(get_size(block) != 0 &&
                  "Called find_prev_fblock on the last block in the heap");
-    // dbg_requires(!get_alloc(block) &&
-    //              "Called find_prev_fblock on an allocated block");
-    if (get_size(block) <= min_block_size) {
-        if (fcounts[0] == 1) {
-            return block;
-        }
-        return find_prev_fmini(block);
+    dbg_requires(!get_alloc(block));
+    if (block->header & mini_free_mask) {
+        word_t flags = alloc_mask | prev_alloc_mask | prev_mini_mask;
+        return (block_t *)(block->header & ~flags);
     }
     return block->data.fblocks.fprev;
 }
 
 /**
- * @brief Add the block to explicit free list
+ * @brief Sets the back link of a free block on the explicit free list.
  *
- * @param[out] block the block to be added
- * @pre block address is not null.
- * @pre a free block
+ * For a mini block this rewrites the header: the size bits are replaced by
+ * the link and `mini_free_mask` is set, while the prev_alloc and prev_mini
+ * flags are preserved.
+ *
+ * @param[out] block A free block
+ * @param[in] prev The block preceding it on the free list
  */
-static void add_to_flist(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires(!get_alloc(block) &&
-                 "Error: Adding an alloc block to free list");
+static void set_prev_fblock(block_t *block, block_t *prev) {
+    dbg_requires(block != NULL && prev != NULL);
+    dbg_requires(!get_alloc(block));
+    if (get_size(block) == min_block_size) {
+        word_t flags = block->header & (prev_alloc_mask | prev_mini_mask);
+        dbg_assert(((word_t)prev & mini_free_mask) != 0);
+        block->header = (word_t)prev | flags;
+    } else {
+        block->data.fblocks.fprev = prev;
+    }
+    dbg_touch(block);
+}
 
-    int idx = find_seglist(get_size(block));
+/**
+ * @brief Orders free blocks in the tree by size, then by address.
+ * @param[in] a
+ * @param[in] b
+ * @return True if `a` sorts before `b`
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
 
-    if (fcounts[idx] == 1) {
-        block->data.fblocks.fnext = seglist[idx];
-        seglist[idx]->data.fblocks.fnext = block;
-        if (idx > 0) {
-            seglist[idx]->data.fblocks.fprev = block;
-            block->data.fblocks.fprev = seglist[idx];
-        }
+/**
+ * @brief Puts `v` in the place of `u` under `u`'s parent.
+ * @param[in] u the subtree being replaced
+ * @param[in] v the replacement, may be NULL
+ */
+static void tree_replace(block_t *u, block_t *v) {
+    block_t *parent = u->data.tnode.parent;
+    if (parent == NULL) {
+        ctl->tree_root = v;
+    } else if (u == parent->data.tnode.left) {
+        parent->data.tnode.left = v;
+    } else {
+        parent->data.tnode.right = v;
     }
-    if (fcounts[idx] > 1) {
-        block_t *temp = seglist[idx]->data.fblocks.fnext;
-        block->data.fblocks.fnext = temp;
-        seglist[idx]->data.fblocks.fnext = block;
-        if (idx > 0) {
-            block->data.fblocks.fprev = seglist[idx];
-            temp->data.fblocks.fprev = block;
-        }
+    if (v != NULL) {
+        v->data.tnode.parent = parent;
     }
-    seglist[idx] = block;
-    fcounts[idx]++;
 }
 
 /**
- * @brief Remove the block from the explicit free list
- *
- * @param[out] block the block to be removed
- * @pre block address is not null.
+ * @brief Rotates `x` down to the left, lifting its right child.
+ * @param[in] x a tree node with a right child
  */
-static void remove_from_flist(block_t *block) {
-    dbg_requires(block != NULL);
-
-    int idx = find_seglist(get_size(block));
+static void tree_left_rotate(block_t *x) {
+    block_t *y = x->data.tnode.right;
+    x->data.tnode.right = y->data.tnode.left;
+    if (y->data.tnode.left != NULL) {
+        y->data.tnode.left->data.tnode.parent = x;
+    }
+    tree_replace(x, y);
+    y->data.tnode.left = x;
+    x->data.tnode.parent = y;
+}
 
-    if (fcounts[idx] == 0) {
-        return;
+/**
+ * @brief Rotates `x` down to the right, lifting its left child.
+ * @param[in] x a tree node with a left child
+ */
+static void tree_right_rotate(block_t *x) {
+    block_t *y = x->data.tnode.left;
+    x->data.tnode.left = y->data.tnode.right;
+    if (y->data.tnode.right != NULL) {
+        y->data.tnode.right->data.tnode.parent = x;
     }
-    if (fcounts[idx] == 1) {
-        dbg_requires(block == seglist[idx]);
-        seglist[idx] = NULL;
-    } else {
-        block_t *prev = find_prev_fblock(block);
-        block_t *next = find_next_fblock(block);
-        prev->data.fblocks.fnext = next;
-        if (idx > 0) {
-            next->data.fblocks.fprev = prev;
-        }
-        if (seglist[idx] == block) {
-            seglist[idx] = next;
+    tree_replace(x, y);
+    y->data.tnode.right = x;
+    x->data.tnode.parent = y;
+}
+
+/**
+ * @brief Moves `x` to the root of the tree by splay rotations.
+ * @param[in] x a tree node
+ */
+static void tree_splay(block_t *x) {
+    block_t *p;
+    while ((p = x->data.tnode.parent) != NULL) {
+        block_t *g = p->data.tnode.parent;
+        bool x_left = (p->data.tnode.left == x);
+        if (g == NULL) {
+            if (x_left) {
+                tree_right_rotate(p);
+            } else {
+                tree_left_rotate(p);
+            }
+        } else if (x_left && g->data.tnode.left == p) {
+            tree_right_rotate(g);
+            tree_right_rotate(p);
+        } else if (!x_left && g->data.tnode.right == p) {
+            tree_left_rotate(g);
+            tree_left_rotate(p);
+        } else if (x_left) {
+            tree_right_rotate(p);
+            tree_left_rotate(g);
+        } else {
+            tree_left_rotate(p);
+            tree_right_rotate(g);
         }
     }
-    fcounts[idx]--;
 }
 
-static void write_header(block_t *block, size_t size, bool alloc,
-                         bool alloc_prev, bool mini_prev) {
-    dbg_requires(block != NULL);
-    // dbg_requires(size > 0);
-
-    // Conditions
-    // dbg_requires((char *)block < (char *)mem_heap_hi() - 7);
-    // dbg_requires((char *)block + size > (char *)mem_heap_lo() + 7);
-    // dbg_requires(size >= min_block_size);
-
-    block->header = pack(size, alloc, alloc_prev, mini_prev);
+/**
+ * @brief Returns the leftmost node of a subtree.
+ * @param[in] u root of a non-empty subtree
+ * @return The smallest block in the subtree
+ */
+static block_t *tree_minimum(block_t *u) {
+    while (u->data.tnode.left != NULL) {
+        u = u->data.tnode.left;
+    }
+    return u;
 }
 
-static void write_footer(block_t *block, size_t size, bool alloc) {
-    dbg_requires(block != NULL);
-
-    // Conditions
-    dbg_requires((char *)block < (char *)mem_heap_hi() - 7);
-    dbg_requires((char *)block + size > (char *)mem_heap_lo() + 7);
-
-    // only write to footer if it's not a mini block
-    if (size > min_block_size) {
-        word_t *footerp = header_to_footer(block);
-        *footerp = pack(size, alloc, false, false);
+/**
+ * @brief Returns the in-order successor of a tree node.
+ * @param[in] u a tree node
+ * @return The next larger block in the tree, or NULL if `u` is the largest
+ */
+static block_t *tree_next(block_t *u) {
+    if (u->data.tnode.right != NULL) {
+        return tree_minimum(u->data.tnode.right);
     }
+    block_t *p = u->data.tnode.parent;
+    while (p != NULL && u == p->data.tnode.right) {
+        u = p;
+        p = p->data.tnode.parent;
+    }
+    return p;
 }
 
 /**
- * @brief Finds the next consecutive block on the heap.
+ * @brief Inserts a large free block into the size-ordered tree.
  *
- * This function accesses the next block in the "implicit list" of the heap
- * by adding the size of the block.
+ * The tree is a splay tree whose nodes are the free blocks themselves,
+ * keyed by size with ties broken by address.
  *
- * @param[in] block A block in the heap
- * @return The next consecutive block on the heap
- * @pre The block is not the epilogue
+ * @param[out] block the block to be added
+ * @pre block is free and at least `tree_min_size` bytes
  */
-static block_t *find_next(block_t *block) {
-    dbg_requires(block != NULL);
-    dbg_requires(get_size(block) != 0 &&
-                 "Called find_next on the last block in the heap");
-    if (block == NULL || get_size(block) == 0) {
-        return NULL;
+static void tree_insert(block_t *block) {
+    dbg_requires(get_size(block) >= tree_min_size);
+
+    block_t *parent = NULL;
+    block_t *z = ctl->tree_root;
+    while (z != NULL) {
+        parent = z;
+        z = tree_less(block, z) ? z->data.tnode.left : z->data.tnode.right;
     }
-    return (block_t *)((char *)block + get_size(block));
+
+    block->data.tnode.left = NULL;
+    block->data.tnode.right = NULL;
+    block->data.tnode.parent = parent;
+    block->data.tnode.freed = ctl->free_clock;
+    if (parent == NULL) {
+        ctl->tree_root = block;
+    } else if (tree_less(block, parent)) {
+        parent->data.tnode.left = block;
+    } else {
+        parent->data.tnode.right = block;
+    }
+    tree_splay(block);
 }
 
 /**
- * @brief Finds the footer of the previous block on the heap.
- * @param[in] block A block in the heap
- * @return The location of the previous block's footer
+ * @brief Removes a block from the size-ordered tree.
+ * @param[out] block the block to be removed
+ * @pre block is in the tree
  */
-static word_t *find_prev_footer(block_t *block) {
-    // Compute previous footer position as one word before the header
-    return &(block->header) - 1;
+static void tree_remove(block_t *block) {
+    tree_splay(block);
+
+    block_t *left = block->data.tnode.left;
+    block_t *right = block->data.tnode.right;
+    if (left == NULL) {
+        tree_replace(block, right);
+    } else if (right == NULL) {
+        tree_replace(block, left);
+    } else {
+        block_t *y = tree_minimum(right);
+        if (y->data.tnode.parent != block) {
+            tree_replace(y, y->data.tnode.right);
+            y->data.tnode.right = right;
+            right->data.tnode.parent = y;
+        }
+        tree_replace(block, y);
+        y->data.tnode.left = left;
+        left->data.tnode.parent = y;
+    }
 }
 
-static block_t *find_mini_prev(block_t *block) {
-    return (block_t *)((char *)block - min_block_size);
+/**
+ * @brief Finds the best fit for a request among the large free blocks.
+ *
+ * Returns the smallest block of at least `asize` bytes, the lowest
+ * addressed one among equals. The last node visited is splayed to the
+ * root, which keeps the amortized cost of a lookup logarithmic.
+ *
+ * @param[in] asize size the free block needs to be at least
+ * @return The best-fitting block, or NULL if none is large enough
+ */
+static block_t *tree_best_fit(size_t asize) {
+    block_t *fit = NULL;
+    block_t *last = NULL;
+    block_t *z = ctl->tree_root;
+    while (z != NULL) {
+        last = z;
+        ctl->fit_probes++;
+        if (get_size(z) >= asize) {
+            fit = z;
+            z = z->data.tnode.left;
+        } else {
+            z = z->data.tnode.right;
+        }
+    }
+    if (last != NULL) {
+        tree_splay(fit != NULL ? fit : last);
+    }
+    return fit;
 }
 
 /**
- * @brief Finds the previous consecutive block on the heap.
+ * @brief Finds the smallest large free block of at least `asize` bytes,
+ *        leaving the tree's shape and the fit statistics alone.
+ *
+ * For walks over the tree that are not fit searches, which should neither
+ * reorder it nor count as probes.
+ *
+ * @param[in] asize least size of the block
+ * @return The smallest such block, or NULL if there is none
+ */
+static block_t *tree_lower_bound(size_t asize) {
+    block_t *fit = NULL;
+    for (block_t *z = ctl->tree_root; z != NULL;) {
+        if (get_size(z) >= asize) {
+            fit = z;
+            z = z->data.tnode.left;
+        } else {
+            z = z->data.tnode.right;
+        }
+    }
+    return fit;
+}
+
+/**
+ * @brief Checks whether a free block is soft-reserved.
+ * @param[in] block a free block
+ * @return True if the block is on the reserve list
+ */
+static bool is_reserved(block_t *block) {
+    return ctl->reserve_count > 0 && get_size(block) > min_block_size &&
+           (*header_to_footer(block) & reserved_mask) != 0;
+}
+
+/**
+ * @brief Soft-reserves a free block.
+ *
+ * The block is kept off the free lists, so fit searches pass it over,
+ * until it is absorbed by the block in front of it or released under
+ * memory pressure.
+ *
+ * @param[out] block a free block larger than `min_block_size`
+ */
+static void reserve_add(block_t *block) {
+    dbg_requires(!get_alloc(block) && get_size(block) > min_block_size);
+    if (ctl->reserve_count == 0) {
+        block->data.fblocks.fnext = block;
+        block->data.fblocks.fprev = block;
+    } else {
+        block_t *head = ctl->reserve_list;
+        block_t *next = head->data.fblocks.fnext;
+        block->data.fblocks.fnext = next;
+        block->data.fblocks.fprev = head;
+        head->data.fblocks.fnext = block;
+        next->data.fblocks.fprev = block;
+    }
+    *header_to_footer(block) |= reserved_mask;
+    ctl->reserve_list = block;
+    ctl->reserve_count++;
+    ctl->reserve_bytes += get_size(block);
+}
+
+/**
+ * @brief Takes a block off the reserve list.
+ * @param[out] block a soft-reserved block
+ */
+static void reserve_remove(block_t *block) {
+    dbg_requires(is_reserved(block));
+    block_t *next = block->data.fblocks.fnext;
+    block_t *prev = block->data.fblocks.fprev;
+    next->data.fblocks.fprev = prev;
+    prev->data.fblocks.fnext = next;
+    if (ctl->reserve_list == block) {
+        ctl->reserve_list = (next == block) ? NULL : next;
+    }
+    *header_to_footer(block) &= ~reserved_mask;
+    ctl->reserve_count--;
+    ctl->reserve_bytes -= get_size(block);
+}
+
+/**
+ * @brief Add the block to explicit free list
+ *
+ * Each seglist is a circular doubly linked list; `seglist[idx]` points at
+ * the most recently inserted block. Insertion and removal are constant
+ * time for every size class, mini blocks included. Blocks too large for
+ * any seglist go to the size-ordered tree instead.
+ *
+ * @param[out] block the block to be added
+ * @pre block address is not null.
+ * @pre a free block
+ */
+static void add_to_flist(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(!get_alloc(block) &&
+                 "Error: Adding an alloc block to free list");
+
+    size_t size = get_size(block);
+    if (size >= tree_min_size) {
+        tree_insert(block);
+        ctl->tree_count++;
+        ctl->tree_bytes += size;
+        return;
+    }
+
+    int idx = find_seglist(size);
+
+    if (ctl->seglist[idx].count == 0) {
+        block->data.fblocks.fnext = block;
+        set_prev_fblock(block, block);
+        ctl->class_bitmap |= (word_t)1 << idx;
+    } else {
+        block_t *head = ctl->seglist[idx].head;
+        block_t *next = head->data.fblocks.fnext;
+        block->data.fblocks.fnext = next;
+        set_prev_fblock(block, head);
+        head->data.fblocks.fnext = block;
+        set_prev_fblock(next, block);
+    }
+    ctl->seglist[idx].head = block;
+    ctl->seglist[idx].count++;
+    ctl->seglist[idx].bytes += size;
+}
+
+/**
+ * @brief Remove the block from the explicit free list
+ *
+ * @param[out] block the block to be removed
+ * @pre block address is not null.
+ * @pre block is on its seglist, in the tree, or on the reserve list
+ */
+static void remove_from_flist(block_t *block) {
+    dbg_requires(block != NULL);
+
+    if (is_reserved(block)) {
+        reserve_remove(block);
+        return;
+    }
+
+    size_t size = get_size(block);
+    if (size >= tree_min_size) {
+        tree_remove(block);
+        ctl->tree_count--;
+        ctl->tree_bytes -= size;
+        return;
+    }
+
+    int idx = find_seglist(size);
+    dbg_requires(ctl->seglist[idx].count > 0);
+
+    if (ctl->seglist[idx].count == 1) {
+        dbg_requires(block == ctl->seglist[idx].head);
+        ctl->seglist[idx].head = NULL;
+        ctl->class_bitmap &= ~((word_t)1 << idx);
+    } else {
+        block_t *prev = find_prev_fblock(block);
+        block_t *next = find_next_fblock(block);
+        prev->data.fblocks.fnext = next;
+        set_prev_fblock(next, prev);
+        if (ctl->seglist[idx].head == block) {
+            ctl->seglist[idx].head = next;
+        }
+    }
+    ctl->seglist[idx].count--;
+    ctl->seglist[idx].bytes -= size;
+}
+
+static void write_header(block_t *block, size_t size, bool alloc,
+                         bool alloc_prev, bool mini_prev) {
+    dbg_requires(block != NULL);
+    // dbg_requires(size > 0);
+
+    // Conditions
+    // dbg_requires((char *)block < (char *)mem_heap_hi() - 7);
+    // dbg_requires((char *)block + size > (char *)mem_heap_lo() + 7);
+    // dbg_requires(size >= min_block_size);
+
+    block->header = pack(size, alloc, alloc_prev, mini_prev);
+    dbg_touch(block);
+}
+
+static void write_footer(block_t *block, size_t size, bool alloc) {
+    dbg_requires(block != NULL);
+
+    // Conditions
+    dbg_requires((char *)block < (char *)mem_heap_hi() - 7);
+    dbg_requires((char *)block + size > (char *)mem_heap_lo() + 7);
+
+    // only write to footer if it's not a mini block
+    if (size > min_block_size) {
+        word_t *footerp = header_to_footer(block);
+        *footerp = pack(size, alloc, false, false);
+    }
+}
+
+/**
+ * @brief Finds the next consecutive block on the heap.
+ *
+ * This function accesses the next block in the "implicit list" of the heap
+ * by adding the size of the block.
+ *
+ * @param[in] block A block in the heap
+ * @return The next consecutive block on the heap
+ * @pre The block is not the epilogue
+ */
+static block_t *find_next(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(get_size(block) != 0 &&
+                 "Called find_next on the last block in the heap");
+    if (block == NULL || get_size(block) == 0) {
+        return NULL;
+    }
+    return (block_t *)((char *)block + get_size(block));
+}
+
+/**
+ * @brief Finds the footer of the previous block on the heap.
+ * @param[in] block A block in the heap
+ * @return The location of the previous block's footer
+ */
+static word_t *find_prev_footer(block_t *block) {
+    // Compute previous footer position as one word before the header
+    return &(block->header) - 1;
+}
+
+static block_t *find_mini_prev(block_t *block) {
+    return (block_t *)((char *)block - min_block_size);
+}
+
+/**
+ * @brief Finds the previous consecutive block on the heap.
  *
  * This is the previous block in the "implicit list" of the heap.
  *
@@ -673,6 +1402,74 @@ static block_t *find_prev(block_t *block) {
     return (block_t *)((char *)block - size);
 }
 
+/**
+ * @brief Moves the clean mark past a block that is being handed out.
+ * @param[in] block an allocated block
+ */
+static void mark_dirty(block_t *block) {
+    char *end = (char *)block + get_size(block);
+    if (end > ctl->clean_lo) {
+        ctl->clean_lo = end;
+    }
+}
+
+/**
+ * @brief Clears metadata words that are becoming the interior of a free
+ *        block, if they lie in the clean part of the heap.
+ * @param[out] lo first word to clear
+ * @param[in] n number of bytes to clear, a multiple of `wsize`
+ */
+static void scrub_clean(void *lo, size_t n) {
+    if ((char *)lo + n <= ctl->clean_lo) {
+        return;
+    }
+    word_t *word = (word_t *)lo;
+    for (size_t i = 0; i < n / wsize; i++) {
+        word[i] = 0;
+    }
+}
+
+/**
+ * @brief Clears the header and links of a free block being absorbed by the
+ *        block in front of it, if they lie in the clean part of the heap.
+ * @param[out] block a free block already taken off its free list
+ */
+static void scrub_absorbed(block_t *block) {
+    size_t size = get_size(block);
+    size_t meta = wsize + sizeof(tnode_t);
+    scrub_clean(block, size < meta ? size : meta);
+}
+
+/**
+ * @brief Acquires a spin lock, yielding the processor while it is held.
+ * @param[in] lock
+ */
+static void lock_acquire(lock_t *lock) {
+    while (atomic_exchange_explicit(lock, 1, memory_order_acquire) != 0) {
+        while (atomic_load_explicit(lock, memory_order_relaxed) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * @brief Acquires a spin lock if it is free.
+ * @param[in] lock
+ * @return True if the lock was acquired
+ */
+static bool lock_try(lock_t *lock) {
+    return atomic_load_explicit(lock, memory_order_relaxed) == 0 &&
+           atomic_exchange_explicit(lock, 1, memory_order_acquire) == 0;
+}
+
+/**
+ * @brief Releases a spin lock.
+ * @param[in] lock
+ */
+static void lock_release(lock_t *lock) {
+    atomic_store_explicit(lock, 0, memory_order_release);
+}
+
 /*
  * ---------------------------------------------------------------------------
  *                        END SHORT HELPER FUNCTIONS
@@ -681,7 +1478,7 @@ static block_t *find_prev(block_t *block) {
 
 /******** The remaining content below are helper and debug routines ********/
 
-static void pheap() {
+static void pheap(void) {
     if (heap_start != NULL) {
         printf("--- Heap ---\n");
         block_t *block;
@@ -703,15 +1500,15 @@ static void pheap() {
     }
 }
 
-static void pfl() {
+static void pfl(void) {
 
     int idx = 0;
 
     for (; idx < LEN; idx++) {
-        if (fcounts[idx] > 0) {
-            printf("--- Free List size: %zu ---\n", min_block_size << idx);
-            block_t *block = seglist[idx];
-            for (int i = 0; i < fcounts[idx]; i++) {
+        if (ctl->seglist[idx].count > 0) {
+            printf("--- Free List size: %zu ---\n", seglist_min_size(idx));
+            block_t *block = ctl->seglist[idx].head;
+            for (uint32_t i = 0; i < ctl->seglist[idx].count; i++) {
                 printf("block: %d: %s, size: %zu,   \taddr: %p\n", i,
                        get_alloc(block) ? "a" : "f", get_size(block),
                        (void *)block);
@@ -720,6 +1517,17 @@ static void pfl() {
             printf("\n");
         }
     }
+    if (ctl->tree_root != NULL) {
+        printf("--- Free Tree ---\n");
+        int i = 0;
+        for (block_t *block = tree_minimum(ctl->tree_root); block != NULL;
+             block = tree_next(block)) {
+            printf("block: %d: %s, size: %zu,   \taddr: %p\n", i++,
+                   get_alloc(block) ? "a" : "f", get_size(block),
+                   (void *)block);
+        }
+        printf("\n");
+    }
     printf("\n\n");
 }
 
@@ -738,8 +1546,14 @@ static block_t *coalesce_block(block_t *block) {
     block_t *prev;
     block_t *next = find_next(block);
 
+    // Start loading a free previous block's header before reading the next
+    // one, so that the two misses overlap
     bool a_prev = get_alloc_prev(block);
+    if (!a_prev) {
+        __builtin_prefetch(find_prev(block), 1);
+    }
     bool a_next = get_alloc(next);
+
     // case 1: both prev next alloc
     if (a_prev && a_next) {
         add_to_flist(block);
@@ -751,6 +1565,8 @@ static block_t *coalesce_block(block_t *block) {
             block_size += get_size(next);
             // remove *next from flist
             remove_from_flist(next);
+            scrub_absorbed(next);
+            ctl->coalesces++;
         }
         // case 3: prev free, next alloc
         else if (!a_prev && a_next) {
@@ -758,7 +1574,9 @@ static block_t *coalesce_block(block_t *block) {
             block_size += get_size(prev);
             // remove *block from flist and point to prev
             remove_from_flist(prev);
+            scrub_clean(find_prev_footer(block), 2 * wsize);
             block = prev;
+            ctl->coalesces++;
         }
         // case 4: both prev and next free
         else {
@@ -767,7 +1585,10 @@ static block_t *coalesce_block(block_t *block) {
             // remove *next and *prev from flist and point to prev
             remove_from_flist(next);
             remove_from_flist(prev);
+            scrub_absorbed(next);
+            scrub_clean(find_prev_footer(block), 2 * wsize);
             block = prev;
+            ctl->coalesces += 2;
         }
         // block->header = pack(block_size, false);
         // word_t *footerp = header_to_footer(block);
@@ -787,6 +1608,24 @@ static block_t *coalesce_block(block_t *block) {
     return block;
 }
 
+/**
+ * @brief Grows the heap by `size` bytes, counting the extension.
+ *
+ * Every growth of the heap goes through here, so that `heap_extends`
+ * counts them all.
+ *
+ * @param[in] size bytes to add, a multiple of `dsize`
+ * @return The start of the new memory, or (void *)-1 if the heap could not
+ *         grow.
+ */
+static void *grow_heap(size_t size) {
+    void *bp = mem_sbrk((intptr_t)size);
+    if (bp != (void *)-1) {
+        ctl->extends++;
+    }
+    return bp;
+}
+
 /**
  * @brief Extend current heap with given size.
  *
@@ -798,7 +1637,7 @@ static block_t *extend_heap(size_t size) {
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
+    if ((bp = grow_heap(size)) == (void *)-1) {
         return NULL;
     }
 
@@ -819,6 +1658,67 @@ static block_t *extend_heap(size_t size) {
     return block;
 }
 
+/**
+ * @brief Finds the block at the top of the heap, if it is free.
+ * @return The top free block, or NULL if the top block is allocated
+ */
+static block_t *heap_top(void) {
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    if (get_alloc_prev(epilogue)) {
+        return NULL;
+    }
+    if (get_mini_prev(epilogue)) {
+        return (block_t *)((char *)epilogue - min_block_size);
+    }
+    return footer_to_header(find_prev_footer(epilogue));
+}
+
+/**
+ * @brief Shrinks the heap, giving back the top free block but `pad` bytes.
+ *
+ * @param[in] pad free bytes to keep at the top of the heap
+ * @return True if the heap shrank, false otherwise.
+ */
+static bool trim_top(size_t pad) {
+    block_t *top = heap_top();
+    if (top == NULL) {
+        return false;
+    }
+    block_t *epilogue;
+    size_t size = get_size(top);
+    size_t keep = round_up(pad, dsize);
+    if (size <= keep) {
+        return false;
+    }
+
+    remove_from_flist(top);
+    if (mem_sbrk(-(intptr_t)(size - keep)) == (void *)-1) {
+        add_to_flist(top);
+        return false;
+    }
+
+    if (keep == 0) {
+        // The epilogue takes the place of the top block, and its flags
+        bool mini_prev = get_mini_prev(top);
+        epilogue = top;
+        write_epilogue(epilogue);
+        write_header(epilogue, 0, true, true, mini_prev);
+    } else {
+        write_header(top, keep, false, true, get_mini_prev(top));
+        write_footer(top, keep, false);
+        add_to_flist(top);
+        epilogue = find_next(top);
+        write_epilogue(epilogue);
+        write_header(epilogue, 0, true, false, keep == min_block_size);
+    }
+
+    // Memory the heap grows into again reads as zero
+    if (ctl->clean_lo > (char *)epilogue) {
+        ctl->clean_lo = (char *)epilogue;
+    }
+    return true;
+}
+
 /**
  * @brief Split an allocated block if the block size minus the payload size
  *        is greater than minimum size required for a free block.
@@ -837,6 +1737,7 @@ static void split_block(block_t *block, size_t asize) {
 
     block_t *block_next;
     if ((block_size - asize) >= min_block_size) {
+        ctl->splits++;
 
         write_header(block, asize, true, get_alloc_prev(block),
                      get_mini_prev(block));
@@ -853,321 +1754,2475 @@ static void split_block(block_t *block, size_t asize) {
     } else {
         block_next = find_next(block);
         write_header(block_next, get_size(block_next), get_alloc(block_next),
-                     true, true);
+                     true, block_size == min_block_size);
     }
 
+    mark_dirty(block);
     dbg_ensures(get_alloc(block));
 }
 
 /**
- * @brief Find a free block equal or bigger than the given size.
+ * @brief Places a request in an allocated block, soft-reserving the space
+ *        left behind it.
  *
- * @param[in] asize size the free block needs to be at least.
- * @return Pointer to the found free block, or NULL if not found.
+ * A free block following `block` is absorbed first. If the space past
+ * `asize` is then at least a regular free block and at most twice `slack`,
+ * all of it becomes a reserved block; otherwise the block is split as
+ * usual.
+ *
+ * @param[in] block an allocated block of at least `asize` bytes
+ * @param[in] asize size the block needs to keep
+ * @param[in] slack growth room wanted behind the block, 0 for none
  */
-static block_t *find_fit(size_t asize) {
+static void place_reserved(block_t *block, size_t asize, size_t slack) {
+    dbg_requires(get_alloc(block));
 
-    // only look for the free block from seglists with bigger size.
-    for (int idx = find_seglist(asize); idx < LEN; idx++) {
-        block_t *block = seglist[idx];
-        // only if the seglist is not empty
-        if (fcounts[idx] > 0) {
-            for (int i = 0; i < fcounts[idx]; i++) {
-                if (asize <= get_size(block)) {
-                    return block;
-                }
-                block = find_next_fblock(block);
-            }
-        }
+    size_t block_size = get_size(block);
+    block_t *next = find_next(block);
+    if (!get_alloc(next)) {
+        size_t next_size = get_size(next);
+        block_size += next_size;
+        remove_from_flist(next);
+        scrub_absorbed(next);
+        write_header(block, block_size, true, get_alloc_prev(block),
+                     get_mini_prev(block));
+    }
+
+    size_t rest = block_size - asize;
+    if (rest <= min_block_size || rest > 2 * slack) {
+        split_block(block, asize);
+        return;
     }
 
-    return NULL; // no fit found
+    write_header(block, asize, true, get_alloc_prev(block),
+                 get_mini_prev(block));
+    mark_dirty(block);
+    block_t *reserve = find_next(block);
+    write_header(reserve, rest, false, true, asize == min_block_size);
+    write_footer(reserve, rest, false);
+    reserve_add(reserve);
+
+    next = find_next(reserve);
+    write_header(next, get_size(next), get_alloc(next), false, false);
 }
 
 /**
- * @brief Helper function to check heap's prologue and epilogue
- *
- * Prologue and epilogue must have size 0 and alloc set to true.
+ * @brief Returns all soft-reserved blocks to the free lists.
  *
- * @param[in] block pointer of type block_t to prologue/epilogue
- * @return true if block is valid, false otherwise
+ * @return True if any block was released
  */
-static bool pro_epilogue_check(block_t *block) {
-    if (get_size(block) != 0) {
-        fprintf(stderr, "Error: heap prologue/epilogue wrong size.\n");
-        return false;
-    }
-    if (!get_alloc(block)) {
-        fprintf(stderr, "Error: heap prologue/epilogue wrong alloc flag.\n");
-        return false;
+static bool reserve_release(void) {
+    bool released = ctl->reserve_count > 0;
+    while (ctl->reserve_count > 0) {
+        block_t *block = ctl->reserve_list;
+        reserve_remove(block);
+        add_to_flist(block);
     }
-
-    return true;
+    return released;
 }
 
 /**
- * @brief Helper function to check block's address is aligned and within
- * boundary.
+ * @brief Finds a good fit for a request on one seglist.
  *
- * An address is aligned in this malloc interface when the address is
- * multiple of 16 (dsize).
+ * Examines blocks starting from the most recently freed one and returns
+ * the one leaving the least space over. Under `MM_FIT_BOUNDED` at most
+ * `fit_candidates` blocks are examined, and the search stops early at a
+ * near-exact fit, one that wastes no more than 1/2^`near_fit_shift` of the
+ * request. `MM_FIT_FIRST` stops at the first block that fits, and
+ * `MM_FIT_BEST` only at an exact fit.
  *
- * @param[in] block pointer of type block_t to the address to be checked.
- * @return true if address is aligned to dsize, false otherwise
+ * @param[in] idx index of a non-empty seglist
+ * @param[in] asize size the free block needs to be at least
+ * @return The best block examined, or NULL if none of them fits
  */
-static bool addr_check(block_t *block) {
-    uintptr_t block_addr = (uintptr_t)(char *)block;
-    // check if within boundary
-    if (block_addr < (uintptr_t)mem_heap_lo() ||
-        block_addr > ((uintptr_t)mem_heap_hi() - 7)) {
-        fprintf(stderr, "Error: Block address is out heap boundaries\n");
-        return false;
+static block_t *seglist_good_fit(int idx, size_t asize) {
+    const int near_fit_shift = 4;
+    uint32_t n = ctl->seglist[idx].count;
+    if (fit_policy == MM_FIT_BOUNDED && n > fit_candidates) {
+        n = fit_candidates;
     }
-    uintptr_t data_addr;
-    if (get_alloc(block)) {
+    size_t good_left = (fit_policy == MM_FIT_FIRST)  ? SIZE_MAX
+                       : (fit_policy == MM_FIT_BEST) ? 0
+                                                     : asize >> near_fit_shift;
+
+    block_t *best = NULL;
+    size_t best_left = 0;
+    block_t *block = ctl->seglist[idx].head;
+    for (uint32_t i = 0; i < n; i++) {
+        // Start loading the next candidate while this one is looked at
+        block_t *next = find_next_fblock(block);
+        __builtin_prefetch(next);
+        size_t size = get_size(block);
+        ctl->fit_probes++;
+        if (size >= asize && (best == NULL || size - asize < best_left)) {
+            best = block;
+            best_left = size - asize;
+            if (best_left <= good_left) {
+                break;
+            }
+        }
+        block = next;
+    }
+    return best;
+}
+
+/**
+ * @brief Find a free block equal or bigger than the given size.
+ *
+ * Large requests are served best-fit from the size-ordered tree. For the
+ * others a fit is looked for on the request's own seglist; failing that,
+ * the class bitmap gives the first non-empty larger seglist, any block of
+ * which fits, and a block is picked from it the same way. If all of those
+ * are empty, the smallest block in the tree is used.
+ *
+ * @param[in] asize size the free block needs to be at least.
+ * @return Pointer to the found free block, or NULL if not found.
+ */
+static block_t *find_fit(size_t asize) {
+    if (asize >= tree_min_size) {
+        return tree_best_fit(asize);
+    }
+
+    int idx = find_seglist(asize);
+
+    if (ctl->seglist[idx].count > 0) {
+        block_t *block = seglist_good_fit(idx, asize);
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    idx = find_seglist_above(idx);
+    if (idx < 0) {
+        return tree_best_fit(asize); // NULL if no fit found
+    }
+    return seglist_good_fit(idx, asize);
+}
+
+/**
+ * @brief Releases the pages inside free blocks of at least
+ *        `release_threshold` bytes that have spent `release_age` ticks in
+ *        the tree.
+ *
+ * Only whole pages between a block's tree links and its footer go, so the
+ * block stays intact; they read as zero when it is handed out again. The
+ * caller must hold the heap lock.
+ */
+static void release_idle(void) {
+    for (block_t *block = tree_lower_bound(release_threshold); block != NULL;
+         block = tree_next(block)) {
+        word_t freed = block->data.tnode.freed;
+        if (freed == 0 || ctl->free_clock - freed < release_age) {
+            continue;
+        }
+        size_t page = mem_pagesize();
+        uintptr_t lo = round_up((uintptr_t)(&block->data.tnode + 1), page);
+        uintptr_t hi = (uintptr_t)header_to_footer(block) & ~(page - 1);
+        if (hi > lo) {
+            mem_discard((void *)lo, hi - lo);
+        }
+        block->data.tnode.freed = 0;
+    }
+}
+
+/**
+ * @brief Frees an ordinary block, coalescing it with its free neighbors.
+ *
+ * The caller must hold the heap lock.
+ *
+ * @param[in] bp the payload of an allocated block that is not a slab run
+ *            object
+ */
+static void block_free(void *bp) {
+    block_t *block = payload_to_header(bp);
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    write_header(block, size, false, get_alloc_prev(block),
+                 get_mini_prev(block));
+    write_footer(block, size, false);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+
+    // Shrink the heap once enough memory is free at its top
+    if (trim_threshold > 0 && get_size(block) >= trim_threshold &&
+        get_size(find_next(block)) == 0) {
+        trim_top(chunksize);
+    }
+
+    // Now and then, give back the pages of large blocks left free a while
+    ctl->free_clock++;
+    if (release_threshold > 0 && ctl->free_clock % release_age == 0) {
+        release_idle();
+    }
+}
+
+/**
+ * @brief Frees every block on the quick lists, coalescing each with its
+ *        free neighbors.
+ *
+ * The caller must hold the heap lock.
+ *
+ * @return true if any block was freed
+ */
+static bool quick_consolidate(void) {
+    if (ctl->quick_bytes == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < QUICK_LISTS; i++) {
+        block_t *block = ctl->quick[i];
+        ctl->quick[i] = NULL;
+        while (block != NULL) {
+            void *bp = header_to_payload(block);
+            block = *(block_t **)bp;
+            block_free(bp);
+        }
+    }
+    ctl->quick_bytes = 0;
+    return true;
+}
+
+/**
+ * @brief Puts a freed block on the quick list for its size instead of
+ *        freeing it.
+ *
+ * Once the quick lists would grow past `quick_limit`, they are
+ * consolidated instead and the block is not taken. The caller must hold
+ * the heap lock.
+ *
+ * @param[in] bp the payload of an allocated block that is not a slab run
+ *            object
+ * @return True if the block is now on a quick list, false if the caller
+ *         must free it.
+ */
+static bool quick_free(void *bp) {
+    if (!defer_coalescing) {
+        return false;
+    }
+    block_t *block = payload_to_header(bp);
+    size_t size = get_size(block);
+    size_t i = (size - quick_min_size) / dsize;
+    if (size < quick_min_size || i >= QUICK_LISTS) {
+        return false;
+    }
+    if (ctl->quick_bytes + size > quick_limit) {
+        quick_consolidate();
+        return false;
+    }
+
+    *(block_t **)bp = ctl->quick[i];
+    ctl->quick[i] = block;
+    ctl->quick_bytes += size;
+    return true;
+}
+
+/**
+ * @brief Takes a block of exactly `asize` bytes off its quick list.
+ *
+ * The caller must hold the heap lock.
+ *
+ * @param[in] asize adjusted block size
+ * @return The block, still marked allocated, or NULL if the list is empty.
+ */
+static block_t *quick_alloc(size_t asize) {
+    if (!defer_coalescing) {
+        return NULL;
+    }
+    size_t i = (asize - quick_min_size) / dsize;
+    if (asize < quick_min_size || i >= QUICK_LISTS) {
+        return NULL;
+    }
+    block_t *block = ctl->quick[i];
+    if (block != NULL) {
+        ctl->quick[i] = *(block_t **)header_to_payload(block);
+        ctl->quick_bytes -= asize;
+        ctl->quick_hits++;
+    }
+    return block;
+}
+
+/**
+ * @brief Computes the gap in front of a payload that would bring it to an
+ *        `align` boundary.
+ * @param[in] payload a payload address
+ * @param[in] align a power of two
+ * @return The gap in bytes, a multiple of `dsize`
+ */
+static size_t aligned_gap(const void *payload, size_t align) {
+    return (size_t)(round_up((uintptr_t)payload, align) - (uintptr_t)payload);
+}
+
+/**
+ * @brief Finds a free block that can hold a block of `asize` bytes at an
+ *        `align` boundary.
+ *
+ * The block that fits `asize` itself is tried first, as its payload may
+ * happen to be aligned well enough; failing that, one large enough for
+ * any alignment is looked for.
+ *
+ * @param[in] asize adjusted block size
+ * @param[in] align required payload alignment
+ * @return The free block, or NULL if none fits
+ */
+static block_t *find_aligned_fit(size_t asize, size_t align) {
+    block_t *block = find_fit(asize);
+    if (block != NULL &&
+        aligned_gap(header_to_payload(block), align) + asize <=
+            get_size(block)) {
+        return block;
+    }
+    return find_fit(asize + align - dsize);
+}
+
+/**
+ * @brief Allocates a block whose payload is aligned to `align` bytes.
+ *
+ * The free block found for the request is split so that the gap in front
+ * of the aligned payload goes back to the free lists as its own block. As
+ * payloads are always `dsize` aligned, that gap is either empty or at
+ * least a mini block. If the heap must grow, it grows only by what the
+ * free block at its top lacks for the aligned block.
+ *
+ * @param[in] asize adjusted block size, as computed by malloc
+ * @param[in] align required payload alignment, a power of two >= dsize
+ * @param[in] limit address the block must end at or below, or NULL
+ * @return The allocated block, or NULL if the heap could not grow or the
+ *         block would end past `limit`.
+ */
+static block_t *alloc_aligned_block(size_t asize, size_t align,
+                                    const char *limit) {
+    block_t *block = find_aligned_fit(asize, align);
+    if (block == NULL && quick_consolidate()) {
+        block = find_aligned_fit(asize, align);
+    }
+    if (block == NULL) {
+        // New memory coalesces with a free top block, or else starts where
+        // the epilogue is now
+        block_t *top = heap_top();
+        size_t have = (top != NULL) ? get_size(top) : 0;
+        char *payload = (top != NULL) ? (char *)header_to_payload(top)
+                                      : (char *)mem_heap_hi() + 1;
+        size_t need = aligned_gap(payload, align) + asize;
+        if (limit != NULL && payload - wsize + need > limit) {
+            return NULL;
+        }
+        block = extend_heap(max((need > have) ? need - have : 0, chunksize));
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    char *payload = header_to_payload(block);
+    if (limit != NULL &&
+        payload - wsize + aligned_gap(payload, align) + asize > limit) {
+        return NULL;
+    }
+    remove_from_flist(block);
+
+    size_t block_size = get_size(block);
+    size_t gap = aligned_gap(header_to_payload(block), align);
+
+    if (gap > 0) {
+        // Return the leading gap to the free lists
+        write_header(block, gap, false, get_alloc_prev(block),
+                     get_mini_prev(block));
+        write_footer(block, gap, false);
+        add_to_flist(block);
+        block_t *aligned = find_next(block);
+        write_header(aligned, block_size - gap, true, false,
+                     gap == min_block_size);
+        block = aligned;
+    } else {
+        write_header(block, block_size, true, get_alloc_prev(block),
+                     get_mini_prev(block));
+    }
+
+    split_block(block, asize);
+    dbg_ensures((uintptr_t)header_to_payload(block) % align == 0);
+    return block;
+}
+
+/**
+ * @brief Finds the bit of the slab run map covering an address.
+ *
+ * @param[in] addr an address in the heap
+ * @return index of the page in the run map, or -1 if it is not covered
+ */
+static long slab_map_index(const void *addr) {
+    uintptr_t page = (uintptr_t)addr / slab_run_size;
+    uintptr_t first = (uintptr_t)ctl / slab_run_size; // ctl is heap start
+    if (page - first >= (uintptr_t)SLAB_MAP_WORDS * 64) {
+        return -1;
+    }
+    return (long)(page - first);
+}
+
+/**
+ * @brief Tells whether a page of the run map holds a slab run.
+ * @param[in] idx index of the page in the run map
+ * @return True if the page holds a run
+ */
+static bool slab_map_test(long idx) {
+    word_t map =
+        atomic_load_explicit(&ctl->slab_map[idx / 64], memory_order_relaxed);
+    return (map >> (idx % 64) & 1) != 0;
+}
+
+/**
+ * @brief Marks or unmarks a page of the run map as holding a slab run.
+ * @param[in] idx index of the page in the run map
+ * @param[in] set True to mark the page, false to unmark it
+ */
+static void slab_map_set(long idx, bool set) {
+    word_t bit = (word_t)1 << (idx % 64);
+    if (set) {
+        atomic_fetch_or_explicit(&ctl->slab_map[idx / 64], bit,
+                                 memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(&ctl->slab_map[idx / 64], ~bit,
+                                  memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Finds the slab run holding a payload pointer, if any.
+ *
+ * The run header is found by rounding the pointer down to the run
+ * alignment; the run map tells whether that page really holds a run.
+ *
+ * @param[in] bp a payload pointer returned by malloc
+ * @return The run containing `bp`, or NULL for an ordinary block.
+ */
+static slab_run_t *slab_run_of(const void *bp) {
+    long idx = slab_map_index(bp);
+    if (idx < 0 || !slab_map_test(idx)) {
+        return NULL;
+    }
+    return (slab_run_t *)((uintptr_t)bp & ~(uintptr_t)(slab_run_size - 1));
+}
+
+/**
+ * @brief Returns a pointer to object `i` of a slab run.
+ * @param[in] run
+ * @param[in] i
+ * @return A pointer to the object's payload
+ */
+static void *slab_object(slab_run_t *run, size_t i) {
+    return (char *)(run + 1) + i * run->osize;
+}
+
+/**
+ * @brief Links a run into the partial list of its class in its arena.
+ * @param[in] run a run with at least one free object
+ */
+static void slab_link(slab_run_t *run) {
+    slab_run_t **list = &ctl->arenas[run->arena].slab_partial[run->cls];
+    run->prev = NULL;
+    run->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = run;
+    }
+    *list = run;
+}
+
+/**
+ * @brief Unlinks a run from the partial list of its class in its arena.
+ * @param[in] run a run on its class's partial list
+ */
+static void slab_unlink(slab_run_t *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        ctl->arenas[run->arena].slab_partial[run->cls] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/**
+ * @brief Hands an empty run, already off its partial list, back to the
+ *        heap. The caller must hold the heap lock.
+ * @param[in] run
+ */
+static void slab_destroy(slab_run_t *run) {
+    slab_map_set(slab_map_index(run), false);
+    block_free(run);
+    // The page given back may make room for a run of any arena
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        atomic_store_explicit(&ctl->arenas[a].runs_exhausted, false,
+                              memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Creates an empty slab run for a size class.
+ *
+ * Runs are only placed in the pages the run map covers, the first
+ * `SLAB_MAP_WORDS * 64` runs' worth of the heap. Once no run fits there,
+ * the arena is marked so that later calls fail at once, without taking
+ * the heap lock, until a run is handed back. The caller must hold the
+ * arena's lock; the heap lock is taken here.
+ *
+ * @param[in] arena arena to own the run
+ * @param[in] cls slab size class
+ * @return The new run, or NULL if none fits in the covered pages or the
+ *         heap could not grow.
+ */
+static slab_run_t *slab_new_run(arena_t *arena, int cls) {
+    if (atomic_load_explicit(&arena->runs_exhausted, memory_order_relaxed)) {
+        return NULL;
+    }
+    const char *limit = (const char *)ctl + SLAB_MAP_WORDS * 64 * slab_run_size;
+    lock_acquire(&ctl->heap_lock);
+    block_t *block = alloc_aligned_block(slab_run_size, slab_run_size, limit);
+    if (block == NULL) {
+        if ((char *)mem_heap_hi() + 1 >= limit) {
+            atomic_store_explicit(&arena->runs_exhausted, true,
+                                  memory_order_relaxed);
+        }
+        lock_release(&ctl->heap_lock);
+        return NULL;
+    }
+
+    slab_run_t *run = header_to_payload(block);
+    long idx = slab_map_index(run);
+    dbg_assert(idx >= 0);
+
+    // The run block's last word is the header of the block after it
+    size_t space = slab_run_size - wsize - sizeof(slab_run_t);
+    run->osize = (uint32_t)((size_t)(cls + 1) * dsize);
+    run->nobjs = (uint32_t)(space / run->osize);
+    run->nfree = run->nobjs;
+    run->cls = (uint16_t)cls;
+    run->arena = (uint16_t)arena->id;
+    dbg_assert(run->nobjs <= SLAB_USED_WORDS * 64);
+    for (size_t i = 0; i < SLAB_USED_WORDS; i++) {
+        // Mark the bits past the last object as permanently in use
+        size_t first = i * 64;
+        if (first + 64 <= run->nobjs) {
+            run->used[i] = 0;
+        } else if (first >= run->nobjs) {
+            run->used[i] = ~(word_t)0;
+        } else {
+            run->used[i] = ~(word_t)0 << (run->nobjs - first);
+        }
+    }
+
+    slab_map_set(idx, true);
+    lock_release(&ctl->heap_lock);
+    slab_link(run);
+    return run;
+}
+
+/**
+ * @brief Allocates a small object from a slab run of an arena.
+ *
+ * The caller must hold the arena's lock.
+ *
+ * @param[in] arena
+ * @param[in] cls slab size class of the object
+ * @return A pointer to the object, or NULL if no run could be made.
+ */
+static void *slab_alloc(arena_t *arena, int cls) {
+    slab_run_t *run = arena->slab_partial[cls];
+    if (run == NULL) {
+        run = slab_new_run(arena, cls);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t w = 0;
+    while (run->used[w] == ~(word_t)0) {
+        w++;
+    }
+    dbg_assert(w < SLAB_USED_WORDS);
+    size_t bit = (size_t)__builtin_ctzll(~run->used[w]);
+    run->used[w] |= (word_t)1 << bit;
+    if (--run->nfree == 0) {
+        slab_unlink(run);
+    }
+    return slab_object(run, w * 64 + bit);
+}
+
+/**
+ * @brief Returns a small object to its slab run.
+ *
+ * A run that becomes empty is handed back to the heap, unless it is the
+ * only run of its class with free objects. The caller must hold the lock
+ * of the run's arena.
+ *
+ * @param[in] run the run holding the object
+ * @param[in] bp the object
+ */
+static void slab_free(slab_run_t *run, void *bp) {
+    size_t i = (size_t)((char *)bp - (char *)slab_object(run, 0)) / run->osize;
+    dbg_assert(slab_object(run, i) == bp);
+    dbg_assert(run->used[i / 64] >> (i % 64) & 1);
+
+    run->used[i / 64] &= ~((word_t)1 << (i % 64));
+    if (run->nfree++ == 0) {
+        slab_link(run);
+    }
+    if (run->nfree == run->nobjs &&
+        (run->prev != NULL || run->next != NULL)) {
+        slab_unlink(run);
+        lock_acquire(&ctl->heap_lock);
+        slab_destroy(run);
+        lock_release(&ctl->heap_lock);
+    }
+}
+
+/**
+ * @brief Hands every empty slab run back to the heap.
+ *
+ * slab_free() keeps the last run of a class around even when it empties,
+ * so that a class that bounces between zero and one object does not
+ * create and destroy a run each time. Those runs are released here when
+ * the heap is about to grow instead.
+ *
+ * The caller holds the heap lock, so arenas that are busy are skipped
+ * rather than waited for.
+ *
+ * @return true if any run was released
+ */
+static bool slab_release_empty(void) {
+    bool released = false;
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        arena_t *arena = &ctl->arenas[a];
+        if (!lock_try(&arena->lock)) {
+            continue;
+        }
+        for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+            slab_run_t *run = arena->slab_partial[cls];
+            if (run != NULL && run->nfree == run->nobjs) {
+                dbg_assert(run->next == NULL);
+                slab_unlink(run);
+                slab_destroy(run);
+                released = true;
+            }
+        }
+        lock_release(&arena->lock);
+    }
+    return released;
+}
+
+/**
+ * @brief Helper function to check heap's prologue and epilogue
+ *
+ * Prologue and epilogue must have size 0 and alloc set to true.
+ *
+ * @param[in] block pointer of type block_t to prologue/epilogue
+ * @return true if block is valid, false otherwise
+ */
+static bool pro_epilogue_check(block_t *block) {
+    if (get_size(block) != 0) {
+        fprintf(stderr, "Error: heap prologue/epilogue wrong size.\n");
+        return false;
+    }
+    if (!get_alloc(block)) {
+        fprintf(stderr, "Error: heap prologue/epilogue wrong alloc flag.\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Helper function to check block's address is aligned and within
+ * boundary.
+ *
+ * An address is aligned in this malloc interface when the address is
+ * multiple of 16 (dsize).
+ *
+ * @param[in] block pointer of type block_t to the address to be checked.
+ * @return true if address is aligned to dsize, false otherwise
+ */
+static bool addr_check(block_t *block) {
+    uintptr_t block_addr = (uintptr_t)(char *)block;
+    // check if within boundary
+    if (block_addr < (uintptr_t)mem_heap_lo() ||
+        block_addr > ((uintptr_t)mem_heap_hi() - 7)) {
+        fprintf(stderr, "Error: Block address is out heap boundaries\n");
+        return false;
+    }
+    uintptr_t data_addr;
+    if (get_alloc(block)) {
         data_addr = (uintptr_t)((char *)header_to_payload(block));
     } else {
-        data_addr = (uintptr_t)((char *)header_to_fblocks(block));
+        data_addr = (uintptr_t)((char *)header_to_fblocks(block));
+    }
+    // check if aligned
+    if ((data_addr % dsize) != 0) {
+        fprintf(stderr, "Error: Block address is not aligned\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Helper function to valid a block.
+ *
+ * Free list links are checked apart, by `flist_ck`.
+ *
+ * @param[in] block pointer of type block_t to the address to be checked.
+ * @return true if address is aligned to dsize, false otherwise
+ * @pre The block must not be a boundary tag.
+ */
+static bool block_ck(block_t *block) {
+    // check 1.
+    if (get_size(block) < min_block_size) {
+        fprintf(stderr, "Error: Block invalid - Not enough size\n");
+        return false;
+    }
+
+    // check 2.
+    if (!get_alloc(block) && get_size(block) > min_block_size) {
+        word_t *footer = header_to_footer(block);
+        if (extract_size(block->header) != extract_size(*footer)) {
+            fprintf(stderr,
+                    "Error: Block invalid - header footer size mismatch.\n");
+            return false;
+        }
+        if (extract_alloc(block->header) != extract_alloc(*footer)) {
+            fprintf(stderr,
+                    "Error: Block invalid - header footer alloc mismatch.\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Helper function to check the slab runs.
+ *
+ * Every page marked in the run map must hold an allocated block of
+ * `slab_run_size` whose occupancy bitmap agrees with its free count, and
+ * every run on a partial list must be marked, have free objects and belong
+ * to the arena whose list it is on. Objects on an arena's remote list must
+ * be allocated objects of that arena's runs.
+ *
+ * @return true if the slab runs are consistent, false otherwise
+ */
+static bool slab_ck(void) {
+    for (size_t w = 0; w < SLAB_MAP_WORDS; w++) {
+        word_t map =
+            atomic_load_explicit(&ctl->slab_map[w], memory_order_relaxed);
+        for (; map != 0; map &= map - 1) {
+            size_t page = w * 64 + (size_t)__builtin_ctzll(map);
+            uintptr_t first = (uintptr_t)ctl / slab_run_size;
+            slab_run_t *run = (slab_run_t *)((first + page) * slab_run_size);
+            block_t *block = payload_to_header(run);
+            if (!get_alloc(block) || get_size(block) != slab_run_size) {
+                fprintf(stderr, "Error: slab run %p is not a run block\n",
+                        (void *)run);
+                return false;
+            }
+            if (run->osize != (run->cls + 1) * dsize) {
+                fprintf(stderr, "Error: slab run %p has a bad class\n",
+                        (void *)run);
+                return false;
+            }
+            uint32_t used = 0;
+            for (size_t i = 0; i < run->nobjs; i++) {
+                used += (uint32_t)(run->used[i / 64] >> (i % 64) & 1);
+            }
+            if (used + run->nfree != run->nobjs) {
+                fprintf(stderr, "Error: slab run %p free count mismatch\n",
+                        (void *)run);
+                return false;
+            }
+        }
+    }
+
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        arena_t *arena = &ctl->arenas[a];
+        for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+            for (slab_run_t *run = arena->slab_partial[cls]; run != NULL;
+                 run = run->next) {
+                if (run->nfree == 0 || run->cls != cls ||
+                    run->arena != arena->id || slab_run_of(run + 1) != run) {
+                    fprintf(stderr,
+                            "Error: bad run %p on slab partial list\n",
+                            (void *)run);
+                    return false;
+                }
+            }
+        }
+
+        // Other threads may still push, but nothing leaves the list while
+        // the arena's lock is held, so the part below the head is stable
+        for (void *bp = atomic_load_explicit(&arena->remote_free,
+                                             memory_order_acquire);
+             bp != NULL; bp = *(void **)bp) {
+            slab_run_t *run = slab_run_of(bp);
+            if (run == NULL) {
+                fprintf(stderr, "Error: remote object %p is not in a run\n",
+                        bp);
+                return false;
+            }
+            size_t i =
+                (size_t)((char *)bp - (char *)slab_object(run, 0)) / run->osize;
+            if (run->arena != arena->id || slab_object(run, i) != bp ||
+                !(run->used[i / 64] >> (i % 64) & 1)) {
+                fprintf(stderr, "Error: bad object %p on remote list\n", bp);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Takes a block out of the bitmap of free blocks built by `heap_ck`.
+ *
+ * Bit `i` of the bitmap stands for the block `i * dsize` bytes past
+ * `heap_start`; it is set for each free block found walking the heap.
+ *
+ * @param[in,out] bits the bitmap
+ * @param[in] block a block found on a free list
+ * @return true if the block is a free block not taken before
+ */
+static bool free_bit_take(word_t *bits, block_t *block) {
+    size_t i = (size_t)((char *)block - (char *)heap_start) / dsize;
+    word_t bit = (word_t)1 << (i % 64);
+    if ((bits[i / 64] & bit) == 0) {
+        return false;
+    }
+    bits[i / 64] &= ~bit;
+    return true;
+}
+
+/**
+ * @brief Helper function to check the seglists.
+ *
+ * Walks each seglist once around, checking that each block on it is a free
+ * block of the heap not met on any list before, that it belongs on this
+ * seglist by size, and that its neighbors on the list link back to it. The
+ * blocks and bytes met must match the counts kept for the seglist, and the
+ * bitmap must mark exactly the non-empty seglists.
+ *
+ * @param[in,out] bits bitmap of free blocks (see `free_bit_take`)
+ * @return true if the seglists are consistent, false otherwise
+ */
+static bool flist_ck(word_t *bits) {
+    for (int idx = 0; idx < LEN; idx++) {
+        bool set = (ctl->class_bitmap >> idx & 1) != 0;
+        if (set != (ctl->seglist[idx].count > 0)) {
+            fprintf(stderr, "Error: seglist %d bitmap mismatch\n", idx);
+            return false;
+        }
+        if (ctl->seglist[idx].count == 0) {
+            if (ctl->seglist[idx].head != NULL || ctl->seglist[idx].bytes != 0) {
+                fprintf(stderr, "Error: empty seglist %d has blocks\n", idx);
+                return false;
+            }
+            continue;
+        }
+
+        block_t *head = ctl->seglist[idx].head;
+        block_t *block = head;
+        word_t bytes = 0;
+        for (uint32_t i = 0; i < ctl->seglist[idx].count; i++) {
+            if (!addr_check(block) || get_alloc(block) ||
+                !free_bit_take(bits, block)) {
+                fprintf(stderr, "Error: bad block %p on seglist %d\n",
+                        (void *)block, idx);
+                return false;
+            }
+            size_t size = get_size(block);
+            if (size >= tree_min_size || find_seglist(size) != idx) {
+                fprintf(stderr,
+                        "Error: block %p of %zu bytes on seglist %d\n",
+                        (void *)block, size, idx);
+                return false;
+            }
+            block_t *next = find_next_fblock(block);
+            if (!addr_check(next) || get_alloc(next) ||
+                find_prev_fblock(next) != block) {
+                fprintf(stderr, "Error: seglist link mismatch at %p\n",
+                        (void *)block);
+                return false;
+            }
+            bytes += size;
+            block = next;
+        }
+        if (block != head || bytes != ctl->seglist[idx].bytes) {
+            fprintf(stderr, "Error: seglist %d count mismatch\n", idx);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Helper function to check the size-ordered tree.
+ *
+ * Walks the tree in order, checking that each node is a free block large
+ * enough to belong there, that its children point back at it, and that
+ * the nodes come out sorted by size and address.
+ *
+ * @param[in,out] bits bitmap of free blocks (see `free_bit_take`)
+ * @return true if the tree is consistent, false otherwise
+ */
+static bool tree_ck(word_t *bits) {
+    block_t *root = ctl->tree_root;
+    if (root == NULL) {
+        if (ctl->tree_count != 0 || ctl->tree_bytes != 0) {
+            fprintf(stderr, "Error: empty free tree has blocks counted\n");
+            return false;
+        }
+        return true;
+    }
+    if (root->data.tnode.parent != NULL) {
+        fprintf(stderr, "Error: tree root %p has a parent\n", (void *)root);
+        return false;
+    }
+
+    block_t *prev = NULL;
+    word_t count = 0;
+    word_t bytes = 0;
+    for (block_t *block = tree_minimum(root); block != NULL;
+         block = tree_next(block)) {
+        if (!addr_check(block) || get_alloc(block) ||
+            get_size(block) < tree_min_size || !free_bit_take(bits, block)) {
+            fprintf(stderr, "Error: bad block %p in free tree\n",
+                    (void *)block);
+            return false;
+        }
+        block_t *left = block->data.tnode.left;
+        block_t *right = block->data.tnode.right;
+        if ((left != NULL && left->data.tnode.parent != block) ||
+            (right != NULL && right->data.tnode.parent != block)) {
+            fprintf(stderr, "Error: free tree parent link mismatch at %p\n",
+                    (void *)block);
+            return false;
+        }
+        if (prev != NULL && !tree_less(prev, block)) {
+            fprintf(stderr, "Error: free tree out of order at %p\n",
+                    (void *)block);
+            return false;
+        }
+        if (block->data.tnode.freed > ctl->free_clock) {
+            fprintf(stderr, "Error: free tree block %p freed in the future\n",
+                    (void *)block);
+            return false;
+        }
+        count++;
+        bytes += get_size(block);
+        prev = block;
+    }
+    if (count != ctl->tree_count || bytes != ctl->tree_bytes) {
+        fprintf(stderr, "Error: free tree count mismatch\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks an initialized heap. The caller must hold every lock.
+ *
+ * Takes time linear in the number of blocks: the walk over the heap marks
+ * each free block in a bitmap, and the walks over the free lists take
+ * them out of it again, so every free block is found on exactly one list.
+ *
+ * @param[in,out] bits zeroed bitmap of a bit per `dsize` bytes of the heap
+ *                     (see `free_bit_take`)
+ * @return true if the heap is consistent, false otherwise
+ */
+static bool heap_walk_ck(word_t *bits) {
+
+    /**
+     * Checking heap with implicit list
+     */
+
+    // 1. check for prologue and epilogue blocks
+    block_t *prologue = (block_t *)(ctl + 1);
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    if (!pro_epilogue_check(prologue)) {
+        return false;
+    }
+    if (!pro_epilogue_check(epilogue)) {
+        return false;
+    }
+
+    block_t *block;
+    word_t free_count = 0;
+    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
+        // 2. check each block's address alignment
+        if (!addr_check(block)) {
+            return false;
+        }
+        // 3. check each block's size, header, and footer
+        if (!block_ck(block)) {
+            return false;
+        }
+        if (!get_alloc(block)) {
+            size_t i = (size_t)((char *)block - (char *)heap_start) / dsize;
+            bits[i / 64] |= (word_t)1 << (i % 64);
+            free_count++;
+        }
+    }
+
+    // 4. check the seglists against the free blocks found
+    if (!flist_ck(bits)) {
+        return false;
+    }
+
+    // 5. check the slab runs
+    if (!slab_ck()) {
+        return false;
+    }
+
+    // 6. check the tree of large free blocks
+    if (!tree_ck(bits)) {
+        return false;
+    }
+
+    // 7. check the soft-reserved blocks
+    block_t *reserve = ctl->reserve_list;
+    word_t reserve_bytes = 0;
+    for (uint32_t i = 0; i < ctl->reserve_count; i++) {
+        if (!addr_check(reserve) || get_alloc(reserve) ||
+            !is_reserved(reserve) || !free_bit_take(bits, reserve) ||
+            reserve->data.fblocks.fnext->data.fblocks.fprev != reserve) {
+            fprintf(stderr, "Error: bad block %p on reserve list\n",
+                    (void *)reserve);
+            return false;
+        }
+        reserve_bytes += get_size(reserve);
+        reserve = reserve->data.fblocks.fnext;
+    }
+    if (reserve != ctl->reserve_list || reserve_bytes != ctl->reserve_bytes) {
+        fprintf(stderr, "Error: reserve list count mismatch\n");
+        return false;
+    }
+
+    // 8. every free block was met on exactly one list
+    word_t listed = ctl->tree_count + ctl->reserve_count;
+    for (int idx = 0; idx < LEN; idx++) {
+        listed += ctl->seglist[idx].count;
+    }
+    if (listed != free_count) {
+        fprintf(stderr, "Error: %" PRIu64 " free blocks in the heap but %"
+                        PRIu64 " on free lists\n",
+                free_count, listed);
+        return false;
+    }
+
+    // 9. check the quick lists
+    word_t quick_bytes = 0;
+    for (size_t i = 0; i < QUICK_LISTS; i++) {
+        for (block_t *block = ctl->quick[i]; block != NULL;
+             block = *(block_t **)header_to_payload(block)) {
+            if (!addr_check(block) || !get_alloc(block) ||
+                get_size(block) != quick_min_size + i * dsize) {
+                fprintf(stderr, "Error: bad block %p on quick list\n",
+                        (void *)block);
+                return false;
+            }
+            quick_bytes += get_size(block);
+        }
+    }
+    if (quick_bytes != ctl->quick_bytes) {
+        fprintf(stderr, "Error: quick list byte count mismatch\n");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks an initialized heap in full. The caller must hold every
+ *        lock.
+ *
+ * The bitmap of free blocks `heap_walk_ck` needs is scratch space mapped
+ * apart from the heap for the duration of the check, which the memory
+ * statistics leave out.
+ *
+ * @return true if the heap is consistent, false otherwise
+ */
+static bool heap_ck(void) {
+    size_t heap_size = (size_t)((char *)mem_heap_hi() + 1 - (char *)heap_start);
+    size_t len = (heap_size / dsize / 64 + 1) * sizeof(word_t);
+    word_t *bits = mem_map_scratch(len);
+    if (bits == NULL) {
+        fprintf(stderr, "Error: no room for the %zu-byte bitmap of free "
+                        "blocks\n",
+                len);
+        return false;
+    }
+    bool ok = heap_walk_ck(bits);
+    mem_unmap_scratch(bits, len);
+    return ok;
+}
+
+/**
+ * @brief Helper function to check the links of a free block.
+ *
+ * The blocks on either side of it on its seglist must link back to it and
+ * belong on the same seglist; its neighbors on the reserve list or in the
+ * tree must link back to it.
+ *
+ * @param[in] block a free block
+ * @return true if the links are consistent, false otherwise
+ */
+static bool flist_links_ck(block_t *block) {
+    size_t size = get_size(block);
+
+    if (is_reserved(block)) {
+        if (block->data.fblocks.fnext->data.fblocks.fprev != block ||
+            block->data.fblocks.fprev->data.fblocks.fnext != block) {
+            fprintf(stderr, "Error: reserve list link mismatch at %p\n",
+                    (void *)block);
+            return false;
+        }
+        return true;
+    }
+
+    if (size >= tree_min_size) {
+        block_t *parent = block->data.tnode.parent;
+        block_t *left = block->data.tnode.left;
+        block_t *right = block->data.tnode.right;
+        if ((parent == NULL && ctl->tree_root != block) ||
+            (parent != NULL && parent->data.tnode.left != block &&
+             parent->data.tnode.right != block) ||
+            (left != NULL && left->data.tnode.parent != block) ||
+            (right != NULL && right->data.tnode.parent != block)) {
+            fprintf(stderr, "Error: free tree link mismatch at %p\n",
+                    (void *)block);
+            return false;
+        }
+        return true;
+    }
+
+    int idx = find_seglist(size);
+    block_t *next = find_next_fblock(block);
+    block_t *prev = find_prev_fblock(block);
+    if (ctl->seglist[idx].count == 0 || !addr_check(next) || !addr_check(prev) ||
+        get_alloc(next) || get_alloc(prev)) {
+        fprintf(stderr, "Error: free block %p is not on a seglist\n",
+                (void *)block);
+        return false;
+    }
+    if (find_prev_fblock(next) != block || find_next_fblock(prev) != block) {
+        fprintf(stderr, "Error: seglist link mismatch at %p\n",
+                (void *)block);
+        return false;
+    }
+    if (find_seglist(get_size(next)) != idx ||
+        find_seglist(get_size(prev)) != idx) {
+        fprintf(stderr, "Error: seglist %d holds a block of the wrong size "
+                        "next to %p\n",
+                idx, (void *)block);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks the blocks logged since the last heap check, with their
+ *        neighbors on the heap and on their free lists. The caller must
+ *        hold every lock.
+ * @return true if those blocks are consistent, false otherwise
+ */
+static bool dirty_ck(void) {
+    block_t *prologue = (block_t *)(ctl + 1);
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    if (!pro_epilogue_check(prologue) || !pro_epilogue_check(epilogue)) {
+        return false;
+    }
+
+    for (word_t i = 0; i < ctl->dirty_count; i++) {
+        block_t *block = ctl->dirty[i];
+        // Logged blocks may since have been given back with the heap top
+        if (block < heap_start || block >= epilogue) {
+            continue;
+        }
+        if (!addr_check(block) || !block_ck(block)) {
+            return false;
+        }
+
+        block_t *next = find_next(block);
+        if (next > epilogue ||
+            (next != epilogue && (!addr_check(next) || !block_ck(next)))) {
+            fprintf(stderr, "Error: bad block %p after %p\n", (void *)next,
+                    (void *)block);
+            return false;
+        }
+        if (get_alloc_prev(next) != get_alloc(block) ||
+            get_mini_prev(next) != (get_size(block) == min_block_size)) {
+            fprintf(stderr, "Error: block %p has stale flags of %p\n",
+                    (void *)next, (void *)block);
+            return false;
+        }
+        if (!get_alloc_prev(block)) {
+            block_t *prev = find_prev(block);
+            if (prev == NULL || prev < heap_start || get_alloc(prev) ||
+                find_next(prev) != block) {
+                fprintf(stderr, "Error: no free block before %p\n",
+                        (void *)block);
+                return false;
+            }
+        }
+
+        if (!get_alloc(block) && !flist_links_ck(block)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Check current heap by checking each block on the heap.
+ *        Check the overall heap's boundaries, prologue, epilogue,
+ *        and each block's address alignment and header footer consistency.
+ *
+ * Every arena lock and the heap lock are held during the check, so it must
+ * not be called by a thread already holding one of them. Objects sitting
+ * in thread caches count as allocated.
+ *
+ * Debug builds log the blocks whose headers change, and check only those
+ * and their neighbors, with a full sweep every `full_check_period` checks
+ * or whenever too many blocks changed to log them all.
+ *
+ * @param[in] line line number when the function is called
+ * @return Error message if heap invalid and nothing otherwise.
+ */
+bool mm_checkheap(int line) {
+
+    // 0. check if the heap is initialized
+    if (!line) {
+        fprintf(stderr, "Error: line number not provided\n");
+        return false;
+    }
+    if (!heap_start) {
+        fprintf(stderr, "Error: heap is not initialized\n");
+        return false;
+    }
+
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        lock_acquire(&ctl->arenas[a].lock);
+    }
+    lock_acquire(&ctl->heap_lock);
+    bool ok;
+    if (!track_dirty || ctl->dirty_count > DIRTY_SLOTS ||
+        ++ctl->checks == full_check_period) {
+        ok = heap_ck();
+        ctl->checks = 0;
+    } else {
+        ok = dirty_ck();
+    }
+    ctl->dirty_count = 0;
+    lock_release(&ctl->heap_lock);
+    for (int a = ARENA_COUNT - 1; a >= 0; a--) {
+        lock_release(&ctl->arenas[a].lock);
+    }
+    return ok;
+}
+
+/**
+ * @brief Finds or makes a free block of at least `asize` bytes and
+ *        allocates the front of it.
+ *
+ * The caller must hold the heap lock.
+ *
+ * @param[in] asize adjusted block size
+ * @param[in] grow whether to grow the heap if nothing fits
+ * @return The allocated block, split down to `asize` if the rest can be
+ *         a block of its own, or NULL if nothing fits and the heap could
+ *         not or may not grow.
+ */
+static block_t *place_fit(size_t asize, bool grow) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+
+    // Search the free list for a fit
+    block = find_fit(asize);
+    if (block == NULL && quick_consolidate()) {
+        block = find_fit(asize);
+    }
+    if (block == NULL) {
+        // Give back empty slab runs and reservations before growing
+        bool released = slab_release_empty();
+        if (reserve_release() || released) {
+            block = find_fit(asize);
+        }
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        if (!grow) {
+            return NULL;
+        }
+        // Always request at least chunksize
+        extendsize = max(asize, chunksize);
+        block = extend_heap(extendsize);
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+    remove_from_flist(block);
+
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    write_header(block, block_size, true, get_alloc_prev(block),
+                 get_mini_prev(block));
+
+    // Try to split the block if too large
+    split_block(block, asize);
+
+    return block;
+}
+
+/**
+ * @brief Allocates an ordinary block.
+ *
+ * The caller must hold the heap lock.
+ *
+ * @param[in] size requested payload size, nonzero
+ * @param[in] grow whether to grow the heap if nothing fits
+ * @return The payload of the new block, or NULL if nothing fits and the
+ *         heap could not or may not grow.
+ */
+static void *block_alloc(size_t size, bool grow) {
+    // Adjust block size to include overhead and to meet alignment requirements
+    size_t asize = round_up(size + wsize, dsize);
+    if (asize < min_block_size) {
+        asize = min_block_size;
+    }
+
+    // A recently freed block of the same size needs no further work
+    block_t *block = quick_alloc(asize);
+    if (block == NULL) {
+        block = place_fit(asize, grow);
+    }
+    return (block != NULL) ? header_to_payload(block) : NULL;
+}
+
+/**
+ * @brief Allocates `n` ordinary blocks of one size, carved back to back
+ *        out of a single fit.
+ *
+ * Only one free block is taken off the lists and only the space left over
+ * is put back, however many blocks are carved. If no free block is large
+ * enough, the blocks are allocated one at a time instead. The caller must
+ * hold the heap lock.
+ *
+ * @param[in] size requested payload size of each block, nonzero
+ * @param[in] n number of blocks
+ * @param[out] ptrs receives the payloads, in address order
+ * @return The number of blocks allocated, less than `n` only if the heap
+ *         could not grow.
+ */
+static size_t block_alloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t asize = round_up(size + wsize, dsize);
+    if (asize < min_block_size) {
+        asize = min_block_size;
+    }
+
+    // Growing the heap for the whole batch would strand the free blocks
+    // it could have filled, so only a fit already on the lists is used
+    block_t *block = NULL;
+    if (n > 1 && n <= (size_t)INTPTR_MAX / asize) {
+        block = place_fit(asize * n, false);
+    }
+    if (block == NULL) {
+        size_t i;
+        for (i = 0; i < n; i++) {
+            if ((ptrs[i] = block_alloc(size, true)) == NULL) {
+                break;
+            }
+        }
+        return i;
+    }
+
+    // The last block keeps whatever split_block could not give back
+    size_t rest = get_size(block);
+    bool alloc_prev = get_alloc_prev(block);
+    bool mini_prev = get_mini_prev(block);
+    for (size_t i = 0; i < n; i++) {
+        size_t bsize = (i + 1 < n) ? asize : rest;
+        write_header(block, bsize, true, alloc_prev, mini_prev);
+        ptrs[i] = header_to_payload(block);
+        rest -= bsize;
+        alloc_prev = true;
+        mini_prev = (bsize == min_block_size);
+        block = find_next(block);
+    }
+    // The block after may be a free mini block keeping its list link in
+    // its header, so only the flags are rewritten
+    word_t flags = prev_alloc_mask | prev_mini_mask;
+    block->header = (block->header & ~flags) | pack(0, false, true, mini_prev);
+    return n;
+}
+
+/**
+ * @brief Returns the calling thread's arena.
+ *
+ * A thread is handed an arena, round robin, the first time it calls into
+ * the allocator after the heap was initialized.
+ *
+ * @return The arena of the calling thread
+ */
+static arena_t *thread_arena(void) {
+    if (thread_state.epoch != heap_epoch) {
+        thread_state.cache = NULL;
+        thread_state.epoch = heap_epoch;
+        word_t n =
+            atomic_fetch_add_explicit(&ctl->threads, 1, memory_order_relaxed);
+        thread_state.arena = (uint32_t)(n % ARENA_COUNT);
+    }
+    return &ctl->arenas[thread_state.arena];
+}
+
+/**
+ * @brief Returns the calling thread's object cache, creating it if needed.
+ *
+ * The cache itself is an ordinary block on the heap.
+ *
+ * @return The thread's cache, or NULL if there is no room for one.
+ */
+static tcache_t *thread_cache(void) {
+    thread_arena();
+    if (thread_state.cache == NULL) {
+        lock_acquire(&ctl->heap_lock);
+        tcache_t *cache = block_alloc(sizeof(tcache_t), true);
+        lock_release(&ctl->heap_lock);
+        if (cache != NULL) {
+            memset(cache, 0, sizeof(tcache_t));
+        }
+        thread_state.cache = cache;
+    }
+    return thread_state.cache;
+}
+
+/**
+ * @brief Pushes an object onto the remote list of the arena owning it.
+ *
+ * Any number of threads may push at once; none of them takes a lock.
+ *
+ * @param[in] arena the arena owning the object's run
+ * @param[in] bp the object
+ */
+static void remote_push(arena_t *arena, void *bp) {
+    void *head = atomic_load_explicit(&arena->remote_free, memory_order_relaxed);
+    do {
+        *(void **)bp = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &arena->remote_free, &head, bp, memory_order_release,
+        memory_order_relaxed));
+}
+
+/**
+ * @brief Returns every object on an arena's remote list to its run.
+ *
+ * The whole list is detached with one exchange, so pushes that race with
+ * the drain simply start a new list. The caller must hold the arena's lock.
+ *
+ * @param[in] arena
+ */
+static void remote_drain(arena_t *arena) {
+    if (atomic_load_explicit(&arena->remote_free, memory_order_relaxed) ==
+        NULL) {
+        return;
+    }
+    void *bp =
+        atomic_exchange_explicit(&arena->remote_free, NULL, memory_order_acquire);
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        slab_free(slab_run_of(bp), bp);
+        bp = next;
+    }
+}
+
+/**
+ * @brief Drains the remote lists of all arenas.
+ *
+ * Used before the heap grows or shrinks, since objects waiting on a remote
+ * list may be all that keeps a run from being released. The caller must
+ * not hold the heap lock.
+ */
+static void remote_collect(void) {
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        arena_t *arena = &ctl->arenas[a];
+        if (atomic_load_explicit(&arena->remote_free, memory_order_relaxed) !=
+            NULL) {
+            lock_acquire(&arena->lock);
+            remote_drain(arena);
+            lock_release(&arena->lock);
+        }
     }
-    // check if aligned
-    if ((data_addr % dsize) != 0) {
-        fprintf(stderr, "Error: Block address is not aligned\n");
-        return false;
+}
+
+/**
+ * @brief Allocates a small object, from the thread's cache if it can.
+ *
+ * Otherwise the arena's lock is taken, and objects other threads have
+ * freed remotely are put back into their runs before one is picked.
+ *
+ * @param[in] size requested payload size, at most `slab_max_size`
+ * @return A pointer to the object, or NULL if no run could be made.
+ */
+static void *small_alloc(size_t size) {
+    int cls = (int)((size - 1) / dsize);
+    arena_t *arena = thread_arena();
+    tcache_t *cache = thread_state.cache;
+    if (cache != NULL && cache->count[cls] > 0) {
+        void *bp = cache->head[cls];
+        cache->head[cls] = *(void **)bp;
+        cache->count[cls]--;
+        return bp;
     }
 
-    return true;
+    lock_acquire(&arena->lock);
+    remote_drain(arena);
+    void *bp = slab_alloc(arena, cls);
+    lock_release(&arena->lock);
+    return bp;
 }
 
 /**
- * @brief Helper function to valid a block.
+ * @brief Allocates `n` small objects of one size under a single take of
+ *        the arena's lock.
+ *
+ * @param[in] size requested payload size, at most `slab_max_size`
+ * @param[in] n number of objects
+ * @param[out] ptrs receives the objects
+ * @return The number of objects allocated, less than `n` only if no more
+ *         runs could be made.
+ */
+static size_t small_alloc_batch(size_t size, size_t n, void **ptrs) {
+    int cls = (int)((size - 1) / dsize);
+    arena_t *arena = thread_arena();
+    tcache_t *cache = thread_state.cache;
+    size_t i = 0;
+    for (; i < n && cache != NULL && cache->count[cls] > 0; i++) {
+        ptrs[i] = cache->head[cls];
+        cache->head[cls] = *(void **)ptrs[i];
+        cache->count[cls]--;
+    }
+    if (i == n) {
+        return n;
+    }
+
+    lock_acquire(&arena->lock);
+    remote_drain(arena);
+    for (; i < n; i++) {
+        if ((ptrs[i] = slab_alloc(arena, cls)) == NULL) {
+            break;
+        }
+    }
+    lock_release(&arena->lock);
+    return i;
+}
+
+/**
+ * @brief Frees a small object into the thread's cache, or into its own
+ *        arena's run once the cache is full.
  *
- * TODO:
- * - Explicit list
- *  4. all prev/next pointers are consistency (A's next is B, A is B's prev)
- *  5. all free blocks are between heap boundaries
- *  6. count free blocks iteratively and match with free block list
- *  7. (seglist) all blocks in each list bucket fall within bucket size range
+ * An object whose run belongs to another arena goes onto that arena's
+ * remote list instead, so the freeing thread never contends for the lock
+ * of an arena it does not allocate from.
  *
- * @param[in] block pointer of type block_t to the address to be checked.
- * @return true if address is aligned to dsize, false otherwise
- * @pre The block must not be a boundary tag.
+ * @param[in] run the run holding the object
+ * @param[in] bp the object
  */
-static bool block_ck(block_t *block) {
-    // check 1.
-    if (get_size(block) < min_block_size) {
-        fprintf(stderr, "Error: Block invalid - Not enough size\n");
-        return false;
+static void small_free(slab_run_t *run, void *bp) {
+    arena_t *arena = &ctl->arenas[run->arena];
+    if (arena != thread_arena()) {
+        remote_push(arena, bp);
+        return;
     }
 
-    // check 2.
-    /**
-     * TODO: Add prev/next check after changing to explicit list
-     */
+    tcache_t *cache = thread_cache();
+    if (cache != NULL && cache->count[run->cls] < TCACHE_COUNT) {
+        *(void **)bp = cache->head[run->cls];
+        cache->head[run->cls] = bp;
+        cache->count[run->cls]++;
+        return;
+    }
 
-    // check 3.
-    if (!get_alloc(block) && get_size(block) > min_block_size) {
-        word_t *footer = header_to_footer(block);
-        if (extract_size(block->header) != extract_size(*footer)) {
-            fprintf(stderr,
-                    "Error: Block invalid - header footer size mismatch.\n");
+    lock_acquire(&arena->lock);
+    slab_free(run, bp);
+    lock_release(&arena->lock);
+}
+
+/**
+ * @brief Returns every object in the calling thread's cache to its run.
+ * @param[in] cache the thread's cache
+ */
+static void tcache_drain(tcache_t *cache) {
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        while (cache->count[cls] > 0) {
+            void *bp = cache->head[cls];
+            cache->head[cls] = *(void **)bp;
+            cache->count[cls]--;
+            slab_run_t *run = slab_run_of(bp);
+            arena_t *arena = &ctl->arenas[run->arena];
+            lock_acquire(&arena->lock);
+            slab_free(run, bp);
+            lock_release(&arena->lock);
+        }
+    }
+}
+
+/**
+ * @brief Empties the calling thread's cache and returns the cache itself
+ *        to the heap.
+ */
+static void tcache_flush(void) {
+    thread_arena();
+    tcache_t *cache = thread_state.cache;
+    if (cache == NULL) {
+        return;
+    }
+    thread_state.cache = NULL;
+    tcache_drain(cache);
+
+    lock_acquire(&ctl->heap_lock);
+    block_free(cache);
+    lock_release(&ctl->heap_lock);
+}
+
+/**
+ * @brief Takes the heap lock and allocates an ordinary block.
+ *
+ * Before the heap grows, the calling thread's cache and the arenas' remote
+ * lists are drained, since the objects in them may be all that keeps some
+ * slab runs from being released to make room. The heap lock is still held
+ * on return.
+ *
+ * @param[in] size requested payload size, nonzero
+ * @param[out] clean_lo set to the clean mark from before the allocation
+ * @return The payload of the new block, or NULL if the heap cannot grow.
+ */
+static void *heap_alloc(size_t size, char **clean_lo) {
+    lock_acquire(&ctl->heap_lock);
+    *clean_lo = ctl->clean_lo;
+    void *bp = block_alloc(size, false);
+    if (bp == NULL) {
+        lock_release(&ctl->heap_lock);
+        tcache_t *cache = thread_state.cache;
+        if (cache != NULL && thread_state.epoch == heap_epoch) {
+            tcache_drain(cache);
+        }
+        remote_collect();
+        lock_acquire(&ctl->heap_lock);
+        *clean_lo = ctl->clean_lo;
+        bp = block_alloc(size, true);
+    }
+    return bp;
+}
+
+/**
+ * @brief Adjusts a tunable allocator parameter.
+ *
+ * `MM_FIT_CANDIDATES` bounds the number of blocks a fit search examines on
+ * a seglist; 1 gives first fit. It is only taken by builds with the
+ * `MM_FIT_BOUNDED` policy, and `MM_QUICK_LIMIT` only by builds deferring
+ * coalescing (see mm-policy.h). `MM_REALLOC_RESERVE` sets the slack kept
+ * behind repeatedly grown blocks, in percent; 0 turns it off.
+ * `MM_TRIM_THRESHOLD` sets how large the free block at the top of the heap
+ * must grow before free shrinks the heap; 0 turns trimming off.
+ * `MM_QUICK_LIMIT` bounds the bytes of freed blocks kept uncoalesced on
+ * the quick lists; 0 turns them off. `MM_MAP_THRESHOLD` sets the request
+ * size from which blocks get regions of their own; 0 turns that off.
+ * `MM_RELEASE_THRESHOLD` sets how large a free block must be for its pages
+ * to be released once it has been free a while; 0 turns that off.
+ *
+ * @param[in] param the parameter to change
+ * @param[in] value its new value
+ * @return True on success, false if the parameter or value is invalid.
+ */
+bool mm_mallopt(int param, long value) {
+    switch (param) {
+    case MM_FIT_CANDIDATES:
+        if (fit_policy != MM_FIT_BOUNDED || value < 1 || value > UINT32_MAX) {
             return false;
         }
-        if (extract_alloc(block->header) != extract_alloc(*footer)) {
-            fprintf(stderr,
-                    "Error: Block invalid - header footer alloc mismatch.\n");
+        fit_candidates = (uint32_t)value;
+        return true;
+    case MM_REALLOC_RESERVE:
+        if (value < 0 || value > 1000) {
+            return false;
+        }
+        reserve_percent = (uint32_t)value;
+        return true;
+    case MM_TRIM_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        trim_threshold = (size_t)value;
+        return true;
+    case MM_QUICK_LIMIT:
+        if (!defer_coalescing || value < 0) {
             return false;
         }
+        quick_limit = (size_t)value;
+        return true;
+    case MM_MAP_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        map_threshold = (size_t)value;
+        return true;
+    case MM_RELEASE_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        release_threshold = (size_t)value;
+        return true;
+    default:
+        return false;
     }
+}
 
-    return true;
+/**
+ * @brief Gives free memory at the top of the heap back to the system.
+ *
+ * The calling thread's cache, the arenas' remote lists and the quick
+ * lists are flushed, and empty slab runs and reservations are released
+ * first, so that they can merge into the top free block.
+ *
+ * @param[in] pad free bytes to leave at the top of the heap
+ * @return True if the heap shrank, false otherwise.
+ */
+bool mm_trim(size_t pad) {
+    if (heap_start == NULL) {
+        return false;
+    }
+    tcache_flush();
+    remote_collect();
+    lock_acquire(&ctl->heap_lock);
+    quick_consolidate();
+    slab_release_empty();
+    reserve_release();
+    bool trimmed = trim_top(pad);
+    lock_release(&ctl->heap_lock);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return trimmed;
 }
 
 /**
- * @brief Check current heap by checking each block on the heap.
- *        Check the overall heap's boundaries, prologue, epilogue,
- *        and each block's address alignment and header footer consistency.
+ * @brief Hands the calling thread's cached objects back to their arenas.
  *
- * @param[in] line line number when the function is called
- * @return Error message if heap invalid and nothing otherwise.
+ * A thread should call this before it exits; objects left in its cache
+ * stay unusable until the heap is initialized again.
  */
-bool mm_checkheap(int line) {
+void mm_thread_detach(void) {
+    if (heap_start == NULL) {
+        return;
+    }
+    tcache_flush();
+    dbg_ensures(mm_checkheap(__LINE__));
+}
 
-    /**
-     * Checking heap with implicit list
-     */
+/**
+ * @brief Returns the number of reallocs that grew a block in place into
+ *        space reserved for it, saving a copy, since `mm_init`.
+ */
+size_t mm_realloc_copies_avoided(void) {
+    return (ctl != NULL) ? (size_t)ctl->copies_avoided : 0;
+}
 
-    // 0. check if the heap is initialized
-    if (!line) {
-        fprintf(stderr, "Error: line number not provided\n");
-        return false;
+/**
+ * @brief Reports the sizes of the heap and its free lists, and the
+ *        counters kept since `mm_init`.
+ *
+ * Everything is read off counters the allocator keeps up to date anyway,
+ * except the largest free block, which is looked for in the tree or on
+ * the highest non-empty seglist. Blocks on the quick lists and in slab
+ * runs count as live.
+ *
+ * @param[out] stats receives the statistics
+ */
+void mm_stats(struct mm_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (heap_start == NULL) {
+        return;
     }
-    if (!heap_start) {
-        fprintf(stderr, "Error: heap is not initialized\n");
+
+    lock_acquire(&ctl->heap_lock);
+    stats->heap_size = mem_heapsize();
+    stats->mapped_size = mem_mapped_size();
+
+    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
+    size_t free_bytes = ctl->tree_bytes + ctl->reserve_bytes;
+    for (int i = 0; i < LEN; i++) {
+        stats->free_bytes[i] = ctl->seglist[i].bytes;
+        stats->fcounts[i] = ctl->seglist[i].count;
+        free_bytes += ctl->seglist[i].bytes;
+    }
+    stats->live_bytes = (size_t)((char *)epilogue - (char *)heap_start) -
+                        free_bytes + stats->mapped_size;
+    stats->tree_bytes = ctl->tree_bytes;
+    stats->tree_count = ctl->tree_count;
+    stats->reserve_bytes = ctl->reserve_bytes;
+    stats->quick_bytes = ctl->quick_bytes;
+
+    if (ctl->tree_root != NULL) {
+        block_t *block = ctl->tree_root;
+        while (block->data.tnode.right != NULL) {
+            block = block->data.tnode.right;
+        }
+        stats->largest_free = get_size(block);
+    } else {
+        for (int i = LEN - 1; i >= 0; i--) {
+            if (ctl->seglist[i].count == 0) {
+                continue;
+            }
+            block_t *block = ctl->seglist[i].head;
+            for (uint32_t j = 0; j < ctl->seglist[i].count; j++) {
+                stats->largest_free = max(stats->largest_free, get_size(block));
+                block = find_next_fblock(block);
+            }
+            break;
+        }
+    }
+
+    stats->splits = ctl->splits;
+    stats->coalesces = ctl->coalesces;
+    stats->heap_extends = ctl->extends;
+    stats->fit_probes = ctl->fit_probes;
+    lock_release(&ctl->heap_lock);
+}
+
+/**
+ * @brief Initialize heap with chunksize.
+ *
+ * No other thread may be using the allocator meanwhile. Thread caches and
+ * arena assignments from an earlier heap are dropped.
+ *
+ * @return True if successfully initialized, false otherwise.
+ */
+bool mm_init(void) {
+
+    // Create the initial empty heap: control block, prologue and epilogue
+    char *base = (char *)(mem_sbrk((intptr_t)(sizeof(ctl_t) + 2 * wsize)));
+
+    if (base == (void *)-1) {
         return false;
     }
 
-    // 1. check for prologue and epilogue blocks
-    block_t *prologue = (block_t *)((char *)mem_heap_lo());
-    block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
-    if (!pro_epilogue_check(prologue)) {
+    ctl = (ctl_t *)base;
+    dbg_assert((uintptr_t)ctl % CACHE_LINE == 0);
+    heap_epoch++;
+    for (int i = 0; i < LEN; i++) {
+        ctl->seglist[i].head = NULL;
+        ctl->seglist[i].count = 0;
+        ctl->seglist[i].bytes = 0;
+    }
+    ctl->class_bitmap = 0;
+    ctl->tree_root = NULL;
+    ctl->tree_count = 0;
+    ctl->tree_bytes = 0;
+    for (int a = 0; a < ARENA_COUNT; a++) {
+        atomic_init(&ctl->arenas[a].lock, 0);
+        ctl->arenas[a].id = (uint32_t)a;
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            ctl->arenas[a].slab_partial[i] = NULL;
+        }
+        atomic_init(&ctl->arenas[a].remote_free, NULL);
+        atomic_init(&ctl->arenas[a].runs_exhausted, false);
+    }
+    for (int i = 0; i < SLAB_MAP_WORDS; i++) {
+        atomic_init(&ctl->slab_map[i], 0);
+    }
+    atomic_init(&ctl->heap_lock, 0);
+    atomic_init(&ctl->threads, 0);
+    ctl->reserve_list = NULL;
+    ctl->reserve_count = 0;
+    ctl->grown_next = 0;
+    for (int i = 0; i < GROWN_SLOTS; i++) {
+        ctl->grown[i] = NULL;
+    }
+    ctl->reserve_bytes = 0;
+    for (int i = 0; i < QUICK_LISTS; i++) {
+        ctl->quick[i] = NULL;
+    }
+    ctl->quick_bytes = 0;
+    ctl->quick_hits = 0;
+    ctl->free_clock = 1;
+    ctl->copies_avoided = 0;
+    ctl->calloc_clean_bytes = 0;
+    ctl->splits = 0;
+    ctl->coalesces = 0;
+    ctl->extends = 0;
+    ctl->fit_probes = 0;
+    ctl->dirty_count = DIRTY_SLOTS + 1;
+    ctl->checks = 0;
+
+    word_t *start = (word_t *)(ctl + 1);
+
+    /*
+     * initialize the prologue and epilogue to track the start and
+     * end of current heap.
+     */
+    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
+    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = (block_t *)&(start[1]);
+    ctl->clean_lo = (char *)heap_start;
+
+    // Extend the empty heap with a free block of chunksize bytes
+    if (extend_heap(chunksize) == NULL) {
         return false;
     }
-    if (!pro_epilogue_check(epilogue)) {
-        return false;
+
+    return true;
+}
+
+/**
+ * @brief Allocates a block in a region of its own.
+ *
+ * The block starts one word into the region, so that its payload is
+ * `dsize` aligned, and ends one word short of the region's end. It has
+ * no neighbors and no footer; its header carries `mapped_mask`.
+ *
+ * @param[in] size requested payload size
+ * @return The payload, or NULL if no region could be mapped
+ */
+static void *map_alloc(size_t size) {
+    size_t page = mem_pagesize();
+    if (size > SIZE_MAX - page - 2 * dsize) {
+        return NULL;
+    }
+    size_t len = round_up(size + wsize + dsize, page);
+    lock_acquire(&ctl->heap_lock);
+    char *region = mem_map(len);
+    lock_release(&ctl->heap_lock);
+    if (region == NULL) {
+        return NULL;
+    }
+    block_t *block = (block_t *)(region + wsize);
+    block->header = pack(len - dsize, true, true, false) | mapped_mask;
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Frees a mapped block, unmapping its region.
+ *
+ * Neighbors of an ordinary block rewrite its header under the heap lock,
+ * so the caller holds that lock from the `get_mapped` test on.
+ *
+ * @param[in] block a block for which `get_mapped` holds
+ */
+static void map_free(block_t *block) {
+    mem_unmap((char *)block - wsize, get_size(block) + dsize);
+}
+
+/**
+ * @brief Allocate memory on the heap for requested size.
+ *
+ * Small requests are served from the thread's cache or its arena's slab
+ * runs, and those of at least `map_threshold` bytes from regions of their
+ * own, which give their memory back as soon as they are freed; all others
+ * come from the shared blocks, under the heap lock.
+ *
+ * @param[in] size size of memory to be allocated.
+ * @return bp pointer to the start address of the allocated space.
+ */
+void *malloc(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Small requests come from slab runs when one can be had, and the
+    // largest from regions of their own
+    if (size <= slab_max_size) {
+        bp = small_alloc(size);
+    } else if (map_threshold > 0 && size >= map_threshold) {
+        bp = map_alloc(size);
+    }
+    if (bp == NULL) {
+        char *clean_lo;
+        bp = heap_alloc(size, &clean_lo);
+        lock_release(&ctl->heap_lock);
+    }
+
+    // DEBUG: print heap and free_list
+    // pheap();
+    // pfl();
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/**
+ * @brief Allocates memory whose payload is aligned to `align` bytes.
+ *
+ * Payloads are always `dsize` aligned, so smaller alignments are simply
+ * malloc. Larger ones get an ordinary block cut out of a free block, with
+ * the gap in front of the aligned payload going back to the free lists
+ * instead of being carried along as padding.
+ *
+ * @param[in] align required alignment, a power of two
+ * @param[in] size size of memory to be allocated
+ * @return The payload, or NULL if `align` is not a power of two, `size` is
+ *         0 or the heap cannot grow.
+ */
+void *mm_memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc(size);
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (heap_start == NULL) {
+        mm_init();
+    }
+    if (size == 0 || size > (size_t)INTPTR_MAX / 2 ||
+        align > (size_t)INTPTR_MAX / 2) {
+        return NULL;
+    }
+
+    size_t asize = max(round_up(size + wsize, dsize), min_block_size);
+    lock_acquire(&ctl->heap_lock);
+    block_t *block = alloc_aligned_block(asize, align, NULL);
+    lock_release(&ctl->heap_lock);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return (block != NULL) ? header_to_payload(block) : NULL;
+}
+
+/**
+ * @brief Allocates memory whose payload is aligned to `align` bytes, as
+ *        C11 aligned_alloc.
+ *
+ * @param[in] align required alignment, a power of two
+ * @param[in] size size of memory to be allocated
+ * @return The payload, or NULL on failure.
+ */
+void *mm_aligned_alloc(size_t align, size_t size) {
+    return mm_memalign(align, size);
+}
+
+/**
+ * @brief Allocates memory whose payload is aligned to `align` bytes, as
+ *        POSIX posix_memalign.
+ *
+ * @param[out] memptr receives the payload, left alone on failure
+ * @param[in] align required alignment, a power of two multiple of
+ *            sizeof(void *)
+ * @param[in] size size of memory to be allocated
+ * @return 0 on success, EINVAL for a bad alignment, ENOMEM if the heap
+ *         cannot grow.
+ */
+int mm_posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0 ||
+        align % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    void *bp = mm_memalign(align, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
     }
+    *memptr = bp;
+    return 0;
+}
 
-    block_t *block;
-    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
-        // 2. check each block's address alignment
-        if (!addr_check(block)) {
-            return false;
-        }
-        // 3. check each block's size, header, and footer
-        if (!block_ck(block)) {
-            return false;
-        }
+/**
+ * @brief Frees a small object, a mapped block or an ordinary block.
+ * @param[in] bp the payload
+ * @param[in] run the slab run holding `bp`, or NULL for any other block
+ */
+static void free_known(void *bp, slab_run_t *run) {
+    if (run != NULL) {
+        small_free(run, bp);
+        return;
+    }
+    lock_acquire(&ctl->heap_lock);
+    if (get_mapped(payload_to_header(bp))) {
+        map_free(payload_to_header(bp));
+    } else if (!quick_free(bp)) {
+        block_free(bp);
     }
+    lock_release(&ctl->heap_lock);
+}
 
-    return true;
+/**
+ * @brief Tells whether a payload holds at least `size` bytes, to check
+ *        the size passed to a sized free or realloc.
+ * @param[in] bp the payload
+ * @param[in] size the size the caller claims
+ * @return True if `size` fits the payload
+ */
+static bool size_fits(void *bp, size_t size) {
+    slab_run_t *run = slab_run_of(bp);
+    if (run != NULL) {
+        return size <= run->osize;
+    }
+    return size <= get_payload_size(payload_to_header(bp));
 }
 
 /**
- * @brief Initialize heap with chunksize.
+ * @brief Free allocated space on the heap.
  *
- * @return True if successfully initialized, false otherwise.
+ * @param[in] bp the pointer to the start of allocated space.
  */
-bool mm_init(void) {
+void free(void *bp) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-    // reset fcount if modified
-    for (int i = 0; i < LEN; i++) {
-        fcounts[i] = 0;
+    if (bp == NULL) {
+        return;
     }
 
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    free_known(bp, slab_run_of(bp));
 
-    if (start == (void *)-1) {
-        return false;
-    }
+    dbg_ensures(mm_checkheap(__LINE__));
 
-    /*
-     * initialize the prologue and epilogue to track the start and
-     * end of current heap.
-     */
-    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
+    // DEBUG: print heap and free_list
+    // pheap();
+    // pfl();
+}
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
+/**
+ * @brief Frees a block whose requested size the caller still knows.
+ *
+ * Only a block requested with at most `slab_max_size` bytes can be a slab
+ * object, so larger ones go straight to the heap without consulting the
+ * run map.
+ *
+ * @param[in] bp the pointer to the start of allocated space
+ * @param[in] size the size the block was requested with (or any size
+ *            between that and its usable size)
+ */
+void mm_free_sized(void *bp, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
+    if (bp == NULL) {
+        return;
     }
+    dbg_requires(size_fits(bp, size));
 
-    return true;
+    free_known(bp, (size <= slab_max_size) ? slab_run_of(bp) : NULL);
+
+    dbg_ensures(mm_checkheap(__LINE__));
 }
 
 /**
- * @brief Allocate memory on the heap for requested size.
+ * @brief Allocates `n` blocks of `size` bytes each.
  *
- * @param[in] size size of memory to be allocated.
- * @return bp pointer to the start address of the allocated space.
+ * Small objects are taken from the thread's cache and its arena's runs
+ * under one take of the arena lock. Larger blocks are carved back to back
+ * out of a single free block, under one take of the heap lock.
+ *
+ * @param[in] size size of each block
+ * @param[in] n number of blocks
+ * @param[out] ptrs receives the `n` pointers
+ * @return The number of blocks allocated; fewer than `n` only if memory
+ *         ran out, and 0 if `size` is 0.
  */
-void *malloc(size_t size) {
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
     dbg_requires(mm_checkheap(__LINE__));
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
     if (heap_start == NULL) {
         mm_init();
     }
-
-    // Ignore spurious request
     if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+        return 0;
     }
 
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-    if (asize < min_block_size) {
-        asize = min_block_size;
+    size_t done = 0;
+    if (size <= slab_max_size) {
+        done = small_alloc_batch(size, n, ptrs);
+    } else if (map_threshold > 0 && size >= map_threshold) {
+        while (done < n && (ptrs[done] = map_alloc(size)) != NULL) {
+            done++;
+        }
+    }
+    if (done < n) {
+        lock_acquire(&ctl->heap_lock);
+        done += block_alloc_batch(size, n - done, ptrs + done);
+        lock_release(&ctl->heap_lock);
     }
 
-    // Search the free list for a fit
-    block = find_fit(asize);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return done;
+}
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
+/**
+ * @brief Sorts an array of pointers by address, in place (heapsort, so
+ *        that nothing needs to be allocated).
+ * @param[in,out] a the array
+ * @param[in] n number of elements
+ */
+static void ptr_sort(void **a, size_t n) {
+    for (size_t end = n, start = n / 2; end > 1;) {
+        if (start > 0) {
+            start--; // still building the heap
+        } else {
+            end--; // move the largest element behind the heap
+            void *t = a[0];
+            a[0] = a[end];
+            a[end] = t;
+        }
+        // sift a[start] down into the heap a[0..end)
+        size_t i = start;
+        for (size_t c = 2 * i + 1; c < end; i = c, c = 2 * i + 1) {
+            if (c + 1 < end && (uintptr_t)a[c + 1] > (uintptr_t)a[c]) {
+                c++;
+            }
+            if ((uintptr_t)a[i] >= (uintptr_t)a[c]) {
+                break;
+            }
+            void *t = a[i];
+            a[i] = a[c];
+            a[c] = t;
         }
     }
+}
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-    remove_from_flist(block);
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    // write_block(block, block_size, true);
-    write_header(block, block_size, true, get_alloc_prev(block),
-                 get_mini_prev(block));
+/**
+ * @brief Frees `n` blocks at once.
+ *
+ * The pointers are sorted by address first. Small objects are freed one
+ * by one as usual. Ordinary blocks that lie back to back are joined into
+ * a single free block, which is coalesced with its neighbors once, all
+ * under one take of the heap lock.
+ *
+ * @param[in,out] ptrs the blocks to free, NULL entries ignored; the array
+ *                is reordered
+ * @param[in] n number of pointers
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    dbg_requires(mm_checkheap(__LINE__));
 
-    // Try to split the block if too large
-    split_block(block, asize);
+    ptr_sort(ptrs, n);
 
-    bp = header_to_payload(block);
+    // Small objects go back to their runs; the rest are kept, in address
+    // order, at the front of the array
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) {
+            continue;
+        }
+        slab_run_t *run = slab_run_of(ptrs[i]);
+        if (run != NULL) {
+            small_free(run, ptrs[i]);
+        } else {
+            ptrs[m++] = ptrs[i];
+        }
+    }
 
-    // DEBUG: print heap and free_list
-    // pheap();
-    // pfl();
+    if (m > 0) {
+        lock_acquire(&ctl->heap_lock);
+        // Mapped blocks are unmapped, leaving only ordinary ones
+        size_t k = 0;
+        for (size_t i = 0; i < m; i++) {
+            if (get_mapped(payload_to_header(ptrs[i]))) {
+                map_free(payload_to_header(ptrs[i]));
+            } else {
+                ptrs[k++] = ptrs[i];
+            }
+        }
+        m = k;
+        for (size_t i = 0, j; i < m; i = j) {
+            block_t *first = payload_to_header(ptrs[i]);
+            block_t *next = find_next(first);
+            for (j = i + 1; j < m && payload_to_header(ptrs[j]) == next; j++) {
+                next = find_next(next);
+            }
+            if (j == i + 1) {
+                if (!quick_free(ptrs[i])) {
+                    block_free(ptrs[i]);
+                }
+                continue;
+            }
+            // Make the whole run one allocated block, then free that
+            size_t size = (size_t)((char *)next - (char *)first);
+            write_header(first, size, true, get_alloc_prev(first),
+                         get_mini_prev(first));
+            block_free(ptrs[i]);
+        }
+        lock_release(&ctl->heap_lock);
+    }
 
     dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
 }
 
 /**
- * @brief Free allocated space on the heap.
+ * @brief Finds a payload among the blocks recently grown by realloc.
+ * @param[in] ptr payload of an allocated block
+ * @return The slot of `grown` holding `ptr`, or -1 if there is none
+ */
+static int grown_lookup(void *ptr) {
+    for (int i = 0; i < GROWN_SLOTS; i++) {
+        if (ctl->grown[i] == ptr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Resizes an allocated block to a nonzero size.
  *
- * @param[in] bp the pointer to the start of allocated space.
+ * A block is resized in place whenever it can be: by taking a free next
+ * block, by sliding the payload down into a free previous block, or, for
+ * the last block in the heap, by growing the heap by just the shortfall.
+ * Only otherwise is the payload copied to a newly allocated block.
+ *
+ * A block grown again while it is still among the last `GROWN_SLOTS` grown
+ * blocks is taken to keep growing: `reserve_percent` of its new size is
+ * soft-reserved behind it, so the next growth can finish in place.
+ *
+ * @param[in] ptr payload of the block
+ * @param[in] run the slab run holding `ptr`, or NULL for an ordinary block
+ * @param[in] live bytes of the payload that must be kept, or `SIZE_MAX`
+ *            to keep all of it
+ * @param[in] size the new size
+ * @return The new payload, or NULL if the block could not be resized.
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
+static void *resize(void *ptr, slab_run_t *run, size_t live, size_t size) {
+    // Slab objects stay put while the new size fits their class
+    if (run != NULL) {
+        if (size <= run->osize) {
+            return ptr;
+        }
+        void *newptr = malloc(size);
+        if (newptr == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, ptr, min(run->osize, live));
+        free_known(ptr, run);
+        return newptr;
+    }
 
-    if (bp == NULL) {
-        return;
+    // Mapped blocks stay put while the new size fills more than half of
+    // their payload
+    block_t *block = payload_to_header(ptr);
+    lock_acquire(&ctl->heap_lock);
+    if (get_mapped(block)) {
+        size_t payload = get_payload_size(block);
+        lock_release(&ctl->heap_lock);
+        if (size <= payload && size > payload / 2) {
+            return ptr;
+        }
+        void *newptr = malloc(size);
+        if (newptr == NULL) {
+            return NULL;
+        }
+        memcpy(newptr, ptr, min(payload, min(live, size)));
+        free_known(ptr, NULL);
+        return newptr;
     }
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    size_t block_size = get_size(block);
+    size_t copysize, asize;
+    void *newptr;
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    asize = round_up(size + wsize, dsize);
+    if (asize < min_block_size) {
+        asize = min_block_size;
+    }
 
-    // Mark the block as free
-    // write_block(block, size, false);
-    write_header(block, size, false, get_alloc_prev(block),
-                 get_mini_prev(block));
-    write_footer(block, size, false);
+    // A block grown again soon after its last growth gets slack behind it
+    size_t slack = 0;
+    int slot = -1;
+    if (asize > block_size && reserve_percent > 0) {
+        slot = grown_lookup(ptr);
+        if (slot >= 0) {
+            slack = round_up(asize / 100 * reserve_percent, dsize);
+        } else {
+            slot = (int)(ctl->grown_next++ % GROWN_SLOTS);
+        }
+    }
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
+    block_t *next = find_next(block);
+    size_t next_size = get_alloc(next) ? 0 : get_size(next);
+    block_t *after = (next_size > 0) ? find_next(next) : next;
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    if (block_size + next_size >= asize) {
+        // Grow (or shrink) in place, taking the next block if it is free
+        if (asize > block_size && is_reserved(next)) {
+            ctl->copies_avoided++;
+        }
+        place_reserved(block, asize, slack);
+        newptr = ptr;
+    } else if (!get_alloc_prev(block) &&
+               get_size(find_prev(block)) + block_size + next_size >= asize) {
+        // Slide the payload down into a free previous block
+        block_t *prev = find_prev(block);
+        copysize = min(get_payload_size(block), live);
+        remove_from_flist(prev);
+        write_header(prev, get_size(prev) + block_size, true,
+                     get_alloc_prev(prev), get_mini_prev(prev));
+        newptr = header_to_payload(prev);
+        memmove(newptr, ptr, copysize);
+        place_reserved(prev, asize, slack);
+    } else if (get_size(after) == 0 &&
+               grow_heap(asize + slack - block_size - next_size) !=
+                   (void *)-1) {
+        // At the end of the heap, grow the heap by just the shortfall
+        write_header(block, asize + slack, true, get_alloc_prev(block),
+                     get_mini_prev(block));
+        if (next_size > 0) {
+            remove_from_flist(next);
+        }
+        write_epilogue(find_next(block));
+        place_reserved(block, asize, slack);
+        newptr = ptr;
+    } else {
+        copysize = get_payload_size(block); // gets size of old payload
+        copysize = min(copysize, min(live, size));
 
-    // DEBUG: print heap and free_list
-    // pheap();
-    // pfl();
+        // The new block may come from a slab run, whose arena lock must
+        // not be taken while holding the heap lock
+        lock_release(&ctl->heap_lock);
+        newptr = malloc(size + slack);
+
+        // If malloc fails, the original block is left untouched
+        if (newptr == NULL) {
+            return NULL;
+        }
+        // Copy the old data
+        memcpy(newptr, ptr, copysize);
+        // Free the old block
+        free_known(ptr, NULL);
+        lock_acquire(&ctl->heap_lock);
+        if (slack > 0 && slab_run_of(newptr) == NULL &&
+            !get_mapped(payload_to_header(newptr))) {
+            place_reserved(payload_to_header(newptr), asize, slack);
+        }
+    }
+
+    if (slot >= 0) {
+        ctl->grown[slot] = newptr;
+    }
+    lock_release(&ctl->heap_lock);
+    return newptr;
 }
 
 /**
@@ -1190,59 +4245,38 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
-    block_t *block = payload_to_header(ptr);
-    block_t *next = find_next(block);
-    bool alloc_next = get_alloc(next);
-    size_t block_size = get_size(block);
-    size_t copysize, asize;
-    void *newptr;
-
-    if (!alloc_next) {
-        block_size += get_size(next);
-    }
-
-    asize = round_up(size + wsize, dsize);
-    if (asize < min_block_size) {
-        asize = min_block_size;
-    }
-
-    if (block_size < asize) {
-        // start code if not enough space -> alloc new space
-
-        // Otherwise, proceed with reallocation
-        newptr = malloc(size);
-
-        // If malloc fails, the original block is left untouched
-        if (newptr == NULL) {
-            return NULL;
-        }
-        // Copy the old data
-        copysize = get_payload_size(block); // gets size of old payload
-        if (size < copysize) {
-            copysize = size;
-        }
-        memcpy(newptr, ptr, copysize);
-        // Free the old block
-        free(ptr);
-    } else {
-        // otherwies, use current block directly
-        if (!alloc_next) {
-            remove_from_flist(next);
-        }
+    return resize(ptr, slab_run_of(ptr), SIZE_MAX, size);
+}
 
-        write_header(block, block_size, true, get_alloc_prev(block),
-                     get_mini_prev(block));
-        split_block(block, asize);
-        newptr = header_to_payload(block);
+/**
+ * @brief Resizes a block whose current requested size the caller knows.
+ *
+ * As with `mm_free_sized`, large blocks skip the run map, and only the
+ * `old_size` bytes the caller can have written are copied when the block
+ * has to move.
+ *
+ * @param[in] ptr Pointer to the payload of an already allocated block.
+ * @param[in] old_size The size the block was last requested with.
+ * @param[in] size The new size the block needs.
+ * @return Pointer to the start of newly allocated space.
+ */
+void *mm_realloc_sized(void *ptr, size_t old_size, size_t size) {
+    if (ptr == NULL || size == 0) {
+        return realloc(ptr, size);
     }
+    dbg_requires(size_fits(ptr, old_size));
 
-    return newptr;
+    slab_run_t *run = (old_size <= slab_max_size) ? slab_run_of(ptr) : NULL;
+    return resize(ptr, run, old_size, size);
 }
 
 /**
  * @brief Allocated requested space on the heap and initialize
  *        the space with 0's.
  *
+ * Memory past the clean mark has not been handed out since the heap grew,
+ * so only the words a free block keeps metadata in need clearing there.
+ *
  * @param[in] elements
  * @param[in] size
  * @return
@@ -1259,13 +4293,51 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    bp = malloc(asize);
+    if (heap_start == NULL) {
+        mm_init();
+    }
+
+    if (asize <= slab_max_size) {
+        bp = malloc(asize);
+        if (bp != NULL) {
+            memset(bp, 0, asize);
+        }
+        return bp;
+    }
+
+    // A fresh region reads as zero already
+    if (map_threshold > 0 && asize >= map_threshold) {
+        bp = map_alloc(asize);
+        if (bp != NULL) {
+            return bp;
+        }
+    }
+
+    dbg_requires(mm_checkheap(__LINE__));
+    char *clean_lo;
+    bp = heap_alloc(asize, &clean_lo);
     if (bp == NULL) {
+        lock_release(&ctl->heap_lock);
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Past the clean mark, only the links and footer of the free block
+    // this came from can be non-zero
+    block_t *block = payload_to_header(bp);
+    size_t dirty = sizeof(tnode_t);
+    if ((char *)bp + dirty < clean_lo) {
+        dirty = (size_t)(clean_lo - (char *)bp);
+    }
+    if (dirty < asize) {
+        *header_to_footer(block) = 0;
+        ctl->calloc_clean_bytes += asize - dirty;
+    } else {
+        dirty = asize;
+    }
+    lock_release(&ctl->heap_lock);
+
+    memset(bp, 0, dirty);
+    dbg_ensures(mm_checkheap(__LINE__));
 
     return bp;
 }
@@ -61,6 +61,175 @@ extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
 #endif
 
+/**
+ * @brief  Tunable allocator parameters, see `mm_mallopt`.
+ */
+enum mm_param {
+    /* Free blocks examined per fit search (1 = first fit) */
+    MM_FIT_CANDIDATES = 1,
+    /* Slack reserved behind repeatedly grown blocks, in percent (0 = off) */
+    MM_REALLOC_RESERVE = 2,
+    /* Free bytes at the top of the heap that make free shrink it (0 = off) */
+    MM_TRIM_THRESHOLD = 3,
+    /* Freed bytes kept uncoalesced for same-size reuse (0 = off) */
+    MM_QUICK_LIMIT = 4,
+    /* Request size from which blocks get regions of their own (0 = off) */
+    MM_MAP_THRESHOLD = 5,
+    /* Free block size from which idle pages are given back (0 = off) */
+    MM_RELEASE_THRESHOLD = 6,
+};
+
+/**
+ * @brief  Adjust a tunable allocator parameter.
+ *
+ * Parameters keep their values across calls to `mm_init`.
+ *
+ * @param[in] param  The parameter to change, one of `enum mm_param`.
+ * @param[in] value  The new value of the parameter.
+ *
+ * @return  True on success, False if the parameter or value is invalid.
+ */
+extern bool mm_mallopt(int param, long value);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `align` bytes.
+ *
+ * @param[in] align  The alignment, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          `align` is invalid or memory ran out.
+ */
+extern void *mm_memalign(size_t align, size_t size);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `align` bytes, as C11
+ *         `aligned_alloc`.
+ *
+ * @param[in] align  The alignment, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          `align` is invalid or memory ran out.
+ */
+extern void *mm_aligned_alloc(size_t align, size_t size);
+
+/**
+ * @brief  Allocate at least `size` bytes aligned to `align` bytes, as
+ *         POSIX `posix_memalign`.
+ *
+ * @param[out] memptr  Receives a pointer to the allocated bytes.
+ * @param[in] align  The alignment, a power of two multiple of
+ *                   `sizeof(void *)`.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL if `align` is invalid, ENOMEM if memory
+ *          ran out.
+ */
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+
+/**
+ * @brief  Free a block whose requested size is known.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size the block was allocated or last reallocated
+ *                  with.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Resize an allocated block whose requested size is known.
+ *
+ * Only the first `old_size` bytes are preserved if the block moves.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] old_size  The size the block was allocated or last
+ *                      reallocated with.
+ * @param[in] size  The new size of the allocated block.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *mm_realloc_sized(void *ptr, size_t old_size, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of `size` bytes each in one call.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks.
+ * @param[out] ptrs  Receives a pointer to each block.
+ *
+ * @return  The number of blocks allocated, fewer than `n` only if memory
+ *          ran out.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Free `n` blocks in one call.
+ *
+ * @param[in,out] ptrs  The blocks to free; NULL entries are ignored. The
+ *                      array is reordered.
+ * @param[in] n  The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Give free memory at the top of the heap back to the system.
+ *
+ * @param[in] pad  Free bytes to leave at the top of the heap.
+ *
+ * @return  True if the heap shrank, False otherwise.
+ */
+extern bool mm_trim(size_t pad);
+
+/**
+ * @brief  Return the calling thread's cached objects to the heap.
+ *
+ * Threads other than the one that called `mm_init` should call this
+ * before they exit.
+ */
+extern void mm_thread_detach(void);
+
+/**
+ * @brief  Count reallocs that grew in place into reserved slack.
+ *
+ * @return  The number of copies avoided since the last `mm_init`.
+ */
+extern size_t mm_realloc_copies_avoided(void);
+
+/** @brief  Most seglist buckets reported by `mm_stats`; builds with fewer
+ *          seglists leave the rest zero. */
+enum { MM_STATS_BUCKETS = 64 };
+
+/**
+ * @brief  Allocator statistics, see `mm_stats`.
+ *
+ * Sizes are in bytes and include block headers. The counters are reset by
+ * `mm_init`.
+ */
+struct mm_stats {
+    size_t heap_size;   /* Bytes of heap */
+    size_t mapped_size; /* Bytes of regions holding giant blocks */
+    size_t live_bytes;  /* Bytes in blocks handed out, slab runs whole */
+    size_t free_bytes[MM_STATS_BUCKETS]; /* Free bytes on each seglist */
+    size_t fcounts[MM_STATS_BUCKETS];    /* Free blocks on each seglist */
+    size_t tree_bytes;     /* Free bytes in the tree of large blocks */
+    size_t tree_count;     /* Free blocks in the tree of large blocks */
+    size_t reserve_bytes;  /* Free bytes reserved behind growing blocks */
+    size_t quick_bytes;    /* Freed bytes waiting on the quick lists */
+    size_t largest_free;   /* Size of the largest free block */
+    size_t splits;         /* Blocks split to place a request */
+    size_t coalesces;      /* Free neighbors merged into a freed block */
+    size_t heap_extends;   /* Calls to extend the heap */
+    size_t fit_probes;     /* Free blocks examined by fit searches */
+};
+
+/**
+ * @brief  Report the state of the allocator.
+ *
+ * @param[out] stats  Receives the statistics.
+ */
+extern void mm_stats(struct mm_stats *stats);
+
 /**
  * @brief  Initialize the heap.
  *
@@ -0,0 +1,162 @@
+/*
+ * mm_test.c - Tests of allocator corner cases that the traces cannot
+ * reach, run by `make test`.
+ *
+ * Each test starts from a fresh heap, drives the allocator through its
+ * public interface, and checks the heap with mm_checkheap along the way.
+ * Failures are reported on stderr and in the exit status.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+static int failures = 0;
+
+/*
+ * check - Report a failed condition of a test
+ */
+static void check(bool ok, const char *test, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL %s: %s\n", test, what);
+        failures++;
+    }
+}
+
+/*
+ * test_trim_mini_below_top - Trim the whole top free block while an
+ * allocated mini block sits just below it. The epilogue that replaces the
+ * top block must keep the prev-mini flag, or freeing the mini block and
+ * growing the heap again would look for a footer it does not have.
+ */
+static void test_trim_mini_below_top(void) {
+    const char *test = "trim_mini_below_top";
+    mem_reset_brk();
+    check(mm_init(), test, "mm_init failed");
+
+    // Shrinking a heap block in place to a mini block leaves the rest of
+    // the initial chunk as the top free block
+    char *p = mm_malloc(200);
+    check(p != NULL, test, "malloc failed");
+    p = mm_realloc(p, 8);
+    check(p != NULL, test, "realloc failed");
+    p[0] = 'x';
+
+    check(mm_trim(0), test, "mm_trim(0) did not shrink the heap");
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after trim");
+
+    mm_free(p);
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after free");
+    char *q = mm_malloc(5000);
+    check(q != NULL, test, "malloc after trim failed");
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after growth");
+    mm_free(q);
+}
+
+/*
+ * test_slab_runs_past_map - Ask for small objects once the heap has grown
+ * past the pages the slab run map covers. No new run may be placed there;
+ * the objects must come from the heap instead, and keep doing so.
+ */
+static void test_slab_runs_past_map(void) {
+    const char *test = "slab_runs_past_map";
+    mem_reset_brk();
+    check(mm_init(), test, "mm_init failed");
+
+    // Fill the covered pages with blocks too big for slabs or regions
+    enum { BIG = 64 * 1024, NBIG = 80, NSMALL = 1024 };
+    static void *big[NBIG];
+    static void *small[NSMALL];
+    for (int i = 0; i < NBIG; i++) {
+        big[i] = mm_malloc(BIG);
+        check(big[i] != NULL, test, "malloc of a big block failed");
+    }
+    check(mem_heapsize() > 4 * 1024 * 1024, test, "heap did not grow far");
+
+    for (int i = 0; i < NSMALL; i++) {
+        small[i] = mm_malloc(16);
+        check(small[i] != NULL, test, "malloc of a small object failed");
+        *(long *)small[i] = i;
+    }
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after objects");
+    for (int i = 0; i < NSMALL; i++) {
+        check(*(long *)small[i] == i, test, "small object overwritten");
+        mm_free(small[i]);
+    }
+    for (int i = 0; i < NBIG; i++) {
+        mm_free(big[i]);
+    }
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after frees");
+}
+
+/*
+ * test_realloc_grows_heap_top - Grow the block at the top of the heap in
+ * place. The heap grows by the shortfall, and that must show in the
+ * count of heap extensions like any other growth.
+ */
+static void test_realloc_grows_heap_top(void) {
+    const char *test = "realloc_grows_heap_top";
+    mem_reset_brk();
+    check(mm_init(), test, "mm_init failed");
+
+    char *p = mm_malloc(3000);
+    check(p != NULL, test, "malloc failed");
+    p[0] = 'x';
+    struct mm_stats before, after;
+    mm_stats(&before);
+    size_t heap_before = mem_heapsize();
+
+    char *q = mm_realloc(p, 6000);
+    check(q == p, test, "block at the top did not grow in place");
+    check(q[0] == 'x', test, "payload not kept");
+    mm_stats(&after);
+    check(mem_heapsize() > heap_before, test, "heap did not grow");
+    check(after.heap_extends == before.heap_extends + 1, test,
+          "growth not counted in heap_extends");
+    check(mm_checkheap(__LINE__), test, "heap inconsistent after realloc");
+    mm_free(q);
+}
+
+/*
+ * test_checkheap_footprint - Check a heap that has no mapped regions. The
+ * scratch space the check needs must not show in the mapped size or the
+ * peak footprint, which stays that of the heap alone.
+ */
+static void test_checkheap_footprint(void) {
+    const char *test = "checkheap_footprint";
+    mem_reset_brk();
+    check(mm_init(), test, "mm_init failed");
+
+    void *p = mm_malloc(100000);
+    check(p != NULL, test, "malloc failed");
+    // Debug builds check the whole heap only every so many checks
+    for (int i = 0; i < 2048; i++) {
+        check(mm_checkheap(__LINE__), test, "heap inconsistent");
+    }
+
+    struct mm_stats stats;
+    mm_stats(&stats);
+    check(stats.mapped_size == 0, test, "check counted in the mapped size");
+    check(mem_peak_footprint() == mem_peak_heapsize(), test,
+          "check counted in the peak footprint");
+    mm_free(p);
+}
+
+int main(void) {
+    mem_init(false);
+
+    test_trim_mini_below_top();
+    test_slab_runs_past_map();
+    test_realloc_grows_heap_top();
+    test_checkheap_footprint();
+
+    mem_deinit();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("mm_test: all tests passed\n");
+    return 0;
+}
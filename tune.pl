@@ -0,0 +1,356 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use File::Spec;
+use POSIX qw(floor);
+
+##############################################################################
+#
+# This program tunes the allocator's size classes and chunk size against a
+# set of traces. Each candidate configuration is built as a policy variant
+# (see the Makefile) and run through mdriver; candidates are scored by the
+# performance index mdriver reports, taken without its caps so that
+# configurations past the targets still rank. The search tries class
+# spacings and tree sizes first, then chunk sizes, then moves, drops and
+# splits single class bounds. The best configuration is written as a
+# header for mm-policy.h (build with -DMM_CLASSES='"<header>"').
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-v] [-j JOBS] [-t DIR] [-r ROUNDS] [-e TOL] [-s SEED] [-o OUT]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "   -h              Print this message\n";
+    printf STDERR "   -v              Verbose mode: print every candidate\n";
+    printf STDERR "   -j JOBS         Run up to JOBS candidates at once, then the best\n";
+    printf STDERR "                   of them alone (default: CPUs)\n";
+    printf STDERR "   -t DIR          Tune against the traces in DIR only\n";
+    printf STDERR "   -r ROUNDS       Rounds of class bound moves (default 8)\n";
+    printf STDERR "   -e TOL          Index points a change must gain (default 2)\n";
+    printf STDERR "   -s SEED         Seed of the class bound moves (default 1)\n";
+    printf STDERR "   -o OUT          Header to write (default mm-classes-tuned.h)\n";
+    die "\n";
+}
+
+$| = 1;       # Autoflush output on every print statement
+
+getopts('hvj:t:r:e:s:o:');
+
+if ($opt_h) {
+    &usage($ARGV[0]);
+}
+
+$verbose = 0;
+if ($opt_v) {
+    $verbose = 1;
+}
+
+# Parameters
+# Programs used
+$make = $ENV{"MAKE"} || "make";
+$mkclasses = "./mkclasses.pl";
+$calibrate = "./calibrate.pl";
+# Objects every candidate driver shares, built once up front
+@shared_objs = ("mdriver.o", "memlib.o", "fcyc.o", "clock.o", "stree.o");
+# Scoring constants, read from the driver's configuration
+$config_file = "./config.h";
+
+# Number of candidates run at once
+$jobs = `grep -c '^processor' /proc/cpuinfo` || 1;
+chomp($jobs);
+if ($opt_j) {
+    $jobs = $opt_j;
+}
+$jobs >= 1 || usage("Need at least one job");
+
+# Rounds of class bound moves, each trying one move per job (and at
+# least 8)
+$rounds = 8;
+if (defined($opt_r)) {
+    $rounds = $opt_r;
+}
+$moves = $jobs < 8 ? 8 : $jobs;
+
+# Gain over the best so far a candidate needs to replace it, in index
+# points. Past its cap the throughput part varies from run to run by a few
+# points, even for runs on their own.
+$tolerance = 2.0;
+if (defined($opt_e)) {
+    $tolerance = $opt_e;
+}
+
+srand(defined($opt_s) ? $opt_s : 1);
+
+$out_file = "mm-classes-tuned.h";
+if ($opt_o) {
+    $out_file = $opt_o;
+}
+
+# Traces: the driver's default suite, or every trace in a directory
+$trace_args = "";
+if ($opt_t) {
+    my @traces = glob("$opt_t/*.rep");
+    @traces > 0 || die "No traces (*.rep) in '$opt_t'\n";
+    # The driver reads -f traces relative to the current directory
+    $trace_args = join(" ", map { "-f " . File::Spec->abs2rel($_) } @traces);
+}
+
+# Block sizes are multiples of this, and the limits mkclasses.pl checks
+$dsize = 16;
+$max_classes = 64;
+$min_tree = 64;
+$max_tree = 1 << 16;
+
+# Candidate search space
+@spacings = (0, 1, 2, 3);
+@tree_sizes = (2048, 4096, 8192, 16384, 32768);
+@chunk_sizes = (2048, 4096, 8192, 16384, 32768, 65536);
+
+# Read the index weights and utilization targets
+sub read_config {
+    my ($name) = @_;
+    my $line = `grep '^#define $name ' $config_file` ||
+        die "Couldn't find $name in '$config_file'\n";
+    my @parts = split " ", $line;
+    return $parts[2] * 1.0;
+}
+$util_weight = read_config("UTIL_WEIGHT");
+$min_space = read_config("MIN_SPACE");
+$max_space = read_config("MAX_SPACE");
+
+# Class lower bounds with 2^spacing linear classes per power of two
+# below tree_size, as mkclasses.pl -s generates them
+sub spaced_bounds {
+    my ($spacing, $tree_size) = @_;
+    my @bounds = ();
+    my $step = $dsize;
+    my $size = 0;
+    my $limit = $dsize << $spacing;
+    while ($size < $tree_size) {
+        push(@bounds, $size);
+        $size += $step;
+        if ($size >= $limit) {
+            $step = $limit >> $spacing;
+            $limit *= 2;
+        }
+    }
+    return @bounds;
+}
+
+# A configuration is a chunk size, the tree's lower bound and the class
+# lower bounds; this is how mkclasses.pl is told about it
+sub classes_args {
+    my ($conf) = @_;
+    return "-c $conf->{chunk} -b " .
+        join(",", @{$conf->{bounds}}, $conf->{tree});
+}
+
+sub describe {
+    my ($conf) = @_;
+    return sprintf("chunk %d, %d classes, tree from %d",
+                   $conf->{chunk}, scalar(@{$conf->{bounds}}), $conf->{tree});
+}
+
+# Score of one driver run: the performance index without its caps, or
+# undef if the run failed
+sub parse_run {
+    my ($log) = @_;
+    open(my $fh, "<", $log) || return undef;
+    my ($util, $tput, $min_tput, $max_tput);
+    while (<$fh>) {
+        if (/^Throughput targets: min=(\d+), max=(\d+)/) {
+            ($min_tput, $max_tput) = ($1, $2);
+        } elsif (/^Average utilization = ([\d.]+)%/) {
+            $util = $1 / 100.0;
+        } elsif (/^Average throughput \(Kops\/sec\) = (\d+)/) {
+            $tput = $1;
+        } elsif (/^Terminated with/) {
+            close($fh);
+            return undef;
+        }
+    }
+    close($fh);
+    return undef unless defined($util) && defined($tput) &&
+        defined($max_tput) && $max_tput > $min_tput;
+    my $p1 = $util_weight * ($util - $min_space) / ($max_space - $min_space);
+    my $p2 = (1.0 - $util_weight) * ($tput - $min_tput) /
+        ($max_tput - $min_tput);
+    return ($p1 + $p2) * 100.0;
+}
+
+# Build and run each configuration, up to $jobs at a time, and set its
+# score. Each run is variant tune-<n> of the Makefile, so runs build and
+# write distinct files.
+$serial = 0;
+sub evaluate {
+    my @confs = @_;
+    my %running = ();
+    my $next = 0;
+    while ($next < @confs || %running) {
+        while ($next < @confs && keys(%running) < $jobs) {
+            my $name = "tune-" . $serial++;
+            my $args = classes_args($confs[$next]);
+            my $pid = fork();
+            defined($pid) || die "Couldn't fork: $!\n";
+            if ($pid == 0) {
+                # Build, and run only if the build succeeded
+                my $status =
+                    system("$make -s VARIANTS=$name '${name}_CLASSES=$args' " .
+                           "mdriver-$name > $name.log 2>&1") ||
+                    system("./mdriver-$name -v 1 $trace_args > $name.log 2>&1");
+                exit($status == 0 ? 0 : 1);
+            }
+            $running{$pid} = [$name, $confs[$next]];
+            $next++;
+        }
+        my $pid = wait();
+        $pid > 0 || die "Lost track of the candidate runs\n";
+        my ($name, $conf) = @{$running{$pid}};
+        delete($running{$pid});
+        $conf->{score} = $? == 0 ? parse_run("$name.log") : undef;
+        if (!defined($conf->{score})) {
+            print "Candidate failed (" . describe($conf) . "), see $name.log\n";
+            next;
+        }
+        if ($verbose > 0) {
+            printf "%8.1f  %s\n", $conf->{score}, describe($conf);
+        }
+        unlink("$name.log", "mdriver-$name", "mm-var-$name.o",
+               "mm-classes-$name.h");
+    }
+}
+
+# Best scored configuration of a list, or undef
+sub best_of {
+    my $best = undef;
+    for my $conf (@_) {
+        if (defined($conf->{score}) &&
+            (!defined($best) || $conf->{score} > $best->{score})) {
+            $best = $conf;
+        }
+    }
+    return $best;
+}
+
+# Take a candidate only if it beats the best by more than the tolerance.
+# Runs sharing CPUs lose throughput to each other, so when candidates ran
+# in parallel the best of them is run again on its own first; every score
+# compared here then comes from a run that had the machine to itself.
+sub improve {
+    my ($best, @confs) = @_;
+    my $cand = best_of(@confs);
+    if (defined($cand) && $jobs > 1 && @confs > 1) {
+        evaluate($cand);
+    }
+    if (defined($cand) && defined($cand->{score}) &&
+        $cand->{score} > $best->{score} + $tolerance) {
+        printf "Index %.1f: %s\n", $cand->{score}, describe($cand);
+        return $cand;
+    }
+    return $best;
+}
+
+# A random multiple of dsize strictly between two sizes, or undef
+sub between {
+    my ($lo, $hi) = @_;
+    my $n = ($hi - $lo) / $dsize - 1;
+    return undef if $n < 1;
+    return $lo + $dsize * (1 + floor(rand($n)));
+}
+
+# The configuration with one class bound moved, dropped or split off, or
+# the tree moved by a factor of two; undef if the move does not apply
+sub mutate {
+    my ($conf) = @_;
+    my @b = @{$conf->{bounds}};
+    my $tree = $conf->{tree};
+    my $kind = floor(rand(4));
+    if ($kind == 0 && @b > 1) {
+        # Move a bound between its neighbors
+        my $i = 1 + floor(rand(@b - 1));
+        my $hi = $i + 1 < @b ? $b[$i + 1] : $tree;
+        $b[$i] = between($b[$i - 1], $hi);
+        return undef unless defined($b[$i]);
+    } elsif ($kind == 1 && @b > 1) {
+        # Merge a class into the one below it
+        splice(@b, 1 + floor(rand(@b - 1)), 1);
+    } elsif ($kind == 2 && @b < $max_classes) {
+        # Split a class
+        my $i = floor(rand(@b));
+        my $hi = $i + 1 < @b ? $b[$i + 1] : $tree;
+        my $mid = between($b[$i], $hi);
+        return undef unless defined($mid);
+        splice(@b, $i + 1, 0, $mid);
+    } elsif ($kind == 3) {
+        # Move the tree, dropping the classes it now covers
+        $tree = rand() < 0.5 ? $tree / 2 : $tree * 2;
+        return undef if $tree < $min_tree || $tree > $max_tree;
+        @b = grep { $_ < $tree } @b;
+    } else {
+        return undef;
+    }
+    return { chunk => $conf->{chunk}, tree => $tree, bounds => [@b] };
+}
+
+# Make sure the driver finds a reference throughput for this machine,
+# rather than measure it again in every run
+system($calibrate) == 0 || die "Couldn't calibrate with $calibrate\n";
+
+# Build what every candidate shares once, so parallel builds don't race
+system("$make -s " . join(" ", $mkclasses, @shared_objs)) == 0 ||
+    die "Couldn't build the driver objects\n";
+
+# Start from the current configuration
+$best = { chunk => 4096, tree => 8192, bounds => [spaced_bounds(2, 8192)] };
+evaluate($best);
+defined($best->{score}) || die "The current configuration fails\n";
+$start = $best;
+printf "Index %.1f: %s (current)\n", $best->{score}, describe($best);
+
+# Class spacings and tree sizes
+@confs = ();
+for my $spacing (@spacings) {
+    for my $tree (@tree_sizes) {
+        my @b = spaced_bounds($spacing, $tree);
+        next if @b > $max_classes;
+        push(@confs, { chunk => $best->{chunk}, tree => $tree,
+                       bounds => [@b] });
+    }
+}
+evaluate(@confs);
+$best = improve($best, @confs);
+
+# Chunk sizes
+@confs = ();
+for my $chunk (@chunk_sizes) {
+    next if $chunk == $best->{chunk};
+    push(@confs, { chunk => $chunk, tree => $best->{tree},
+                   bounds => $best->{bounds} });
+}
+evaluate(@confs);
+$best = improve($best, @confs);
+
+# Single class bound moves
+for (my $r = 0; $r < $rounds; $r++) {
+    @confs = ();
+    for (my $i = 0; $i < 4 * $moves && @confs < $moves; $i++) {
+        my $conf = mutate($best);
+        push(@confs, $conf) if defined($conf);
+    }
+    evaluate(@confs);
+    $best = improve($best, @confs);
+}
+
+# Write the best configuration
+$args = classes_args($best);
+$header = `$mkclasses $args` || die "Couldn't generate '$out_file'\n";
+$note = sprintf(" * Chosen by tune.pl: index %.1f against %.1f for the " .
+                "default\n * configuration, with the index taken " .
+                "without its caps.\n", $best->{score}, $start->{score});
+$header =~ s/( \* Generated by .*\n)/$1$note/;
+open(my $fh, ">", $out_file) || die "Couldn't write '$out_file': $!\n";
+print $fh $header;
+close($fh);
+printf "Wrote %s: %s, index %.1f\n", $out_file, describe($best),
+    $best->{score};